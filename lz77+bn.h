@@ -3,6 +3,8 @@
 
 #include <errno.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 // Naive LZ77 implementation inspired by CharGPT discussion
 // and my personal passion to compressors in 198x
@@ -15,6 +17,12 @@ enum {
     lz77_alphabet   = 1 << lz77_max_window
 };
 
+enum { // match finders (same values as lz77.h):
+    lz77_finder_level = 0, // default: hash chains
+    lz77_finder_chain = 1, // hash chains
+    lz77_finder_scan  = 2, // exhaustive scan of the whole window (slow)
+};
+
 typedef struct lz77_binheap_s {
     int32_t  ns[lz77_alphabet]; // nodes
     int32_t  sx[lz77_alphabet]; // symbol -> ix in ns[]
@@ -30,6 +38,9 @@ typedef struct lz77_s {
     uint64_t (*read)(lz77_t*); //  reads 64 bits
     void     (*write)(lz77_t*, uint64_t b64); // writes 64 bits
     uint64_t written;
+    // compress() parameters, zero means default:
+    uint8_t  finder; // lz77_finder_*
+    uint32_t chain;  // maximum number of hash chain candidates to check
     lz77_binheap_t bh_txt;
     lz77_binheap_t bh_pos;
     lz77_binheap_t bh_len;
@@ -73,6 +84,62 @@ extern lz77_if lz77;
     return;                                             \
 } while (0)
 
+#if defined(__AVX2__)
+#define lz77_avx2
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define lz77_sse2
+#endif
+
+#if defined(lz77_sse2) || defined(lz77_avx2)
+#include <immintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#if (defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86) || \
+     defined(_M_ARM64))) || (defined(__BYTE_ORDER__) && \
+     __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define lz77_little_endian
+#endif
+
+static inline uint32_t lz77_ctz32(uint32_t x) { // x != 0
+    #ifdef _MSC_VER
+        unsigned long i;
+        _BitScanForward(&i, x);
+        return (uint32_t)i;
+    #else
+        return (uint32_t)__builtin_ctz(x);
+    #endif
+}
+
+static inline uint32_t lz77_ctz64(uint64_t x) { // x != 0
+    #if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+        unsigned long i;
+        _BitScanForward64(&i, x);
+        return (uint32_t)i;
+    #elif defined(_MSC_VER)
+        const uint32_t lo = (uint32_t)x;
+        return lo != 0 ? lz77_ctz32(lo) : 32 + lz77_ctz32((uint32_t)(x >> 32));
+    #else
+        return (uint32_t)__builtin_ctzll(x);
+    #endif
+}
+
+static inline uint32_t lz77_clz32(uint32_t x) { // x != 0
+    #ifdef _MSC_VER
+        unsigned long i;
+        _BitScanReverse(&i, x);
+        return 31 - (uint32_t)i;
+    #else
+        return (uint32_t)__builtin_clz(x);
+    #endif
+}
+
 #ifdef lz77_historgram
 
 static inline uint32_t lz77_bit_count(size_t v) {
@@ -189,35 +256,39 @@ static void lz77_binheap_init(lz77_binheap_t* t, int32_t nc) { // node count
     lz77_assert(t->nc == nc);
 }
 
-static inline void lz77_write_bit(lz77_t* lz, uint64_t* b64,
-        uint32_t* bp, uint64_t bit) {
-    if (*bp == 64 && lz->error == 0) {
-        lz->write(lz, *b64);
-        *b64 = 0;
-        *bp = 0;
-        if (lz->error == 0) { lz->written += 8; }
-    }
-    *b64 |= bit << *bp;
-    (*bp)++;
-}
+// Bits are appended least significant first into `b64`, `bp` bits are
+// in use. Whole 64 bit words are written out as soon as they fill up
+// and lz->error is only checked then.
 
 static inline void lz77_write_bits(lz77_t* lz, uint64_t* b64,
         uint32_t* bp, uint64_t bits, uint32_t n) {
-    rt_assert(n <= 64);
-    while (n > 0) {
-        lz77_write_bit(lz, b64, bp, bits & 1);
-        bits >>= 1;
-        n--;
+    rt_assert(n <= 57 && *bp < 64);
+    bits &= ((uint64_t)1 << n) - 1;
+    *b64 |= bits << *bp;
+    *bp += n;
+    if (*bp >= 64) {
+        if (lz->error == 0) { lz->write(lz, *b64); }
+        if (lz->error == 0) { lz->written += 8; }
+        *bp -= 64;
+        *b64 = bits >> (n - *bp);
     }
 }
 
+static inline void lz77_write_bit(lz77_t* lz, uint64_t* b64,
+        uint32_t* bp, uint64_t bit) {
+    lz77_write_bits(lz, b64, bp, bit, 1);
+}
+
+// `base` bits of the number followed by continue bit per group
+
 static inline void lz77_write_number(lz77_t* lz, uint64_t* b64,
         uint32_t* bp, uint64_t bits, uint8_t base) {
-    do {
-        lz77_write_bits(lz, b64, bp, bits, base);
+    const uint64_t mask = ((uint64_t)1 << base) - 1;
+    while (bits > mask) {
+        lz77_write_bits(lz, b64, bp, (bits & mask) | (mask + 1), base + 1);
         bits >>= base;
-        lz77_write_bit(lz, b64, bp, bits != 0); // continue bit
-    } while (bits != 0);
+    }
+    lz77_write_bits(lz, b64, bp, bits, base + 1);
 }
 
 static inline void lz77_flush(lz77_t* lz, uint64_t b64, uint32_t bp) {
@@ -235,6 +306,279 @@ static void lz77_write_header(lz77_t* lz, size_t bytes, uint8_t window_bits) {
     lz->write(lz, (uint64_t)window_bits);
 }
 
+// Match finder: hash chains (zlib style) keyed on the next
+// lz77_min_match bytes. head[] maps a hash to the most recent position + 1
+// and chain[] links each position to the previous one with the same hash.
+// Positions are stored as uint32_t + 1 (0 means empty); only the distance
+// `i - j` is ever used, so wrap around on inputs above 4GB is harmless:
+// every candidate is verified byte by byte before it is accepted.
+
+enum {
+    lz77_min_match     = 3,   // shortest match worth encoding
+    lz77_hash_bits_min = 10,  // head[] has 1 << hash_bits entries
+    lz77_hash_bits_max = 16,
+    lz77_default_chain = 256  // candidates checked per position
+};
+
+typedef struct lz77_finder_s {
+    const uint8_t* data;
+    size_t    bytes;
+    size_t    window;
+    uint8_t   type;  // lz77_finder_*
+    uint32_t  depth; // maximum number of chain candidates to check
+    uint32_t* head;  // [1 << hash_bits]
+    uint8_t   hash_bits;
+    uint32_t* chain; // [mask + 1] ring buffer indexed by position
+    size_t    mask;
+} lz77_finder_t;
+
+// Multiplicative (Fibonacci) hash of the first `len` [3..5] bytes at `p`
+// with a single unaligned load: the bytes that are not hashed are shifted
+// out and the product's top `bits` are the most mixed ones. Reads
+// lz77_hash_read(len) bytes at `p`.
+
+static inline uint8_t lz77_hash_read(uint8_t len) {
+    return len <= 4 ? 4 : 8;
+}
+
+static inline uint32_t lz77_hash(const uint8_t* p, uint8_t len,
+        uint8_t bits) {
+    if (len <= 4) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        #ifdef lz77_little_endian
+        v <<= (4 - len) * 8;
+        #else
+        v >>= (4 - len) * 8;
+        #endif
+        return (v * 2654435761U) >> (32 - bits);
+    } else {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        #ifdef lz77_little_endian
+        v <<= (8 - len) * 8;
+        #else
+        v >>= (8 - len) * 8;
+        #endif
+        return (uint32_t)((v * 0x9E3779B97F4A7C15ULL) >> (64 - bits));
+    }
+}
+
+static void lz77_finder_init(lz77_t* lz, lz77_finder_t* f,
+        const uint8_t* data, size_t bytes, size_t window) {
+    memset(f, 0x00, sizeof(*f));
+    f->data   = data;
+    f->bytes  = bytes;
+    f->window = window;
+    f->type   = lz->finder != lz77_finder_level ?
+                lz->finder : lz77_finder_chain;
+    f->depth  = lz->chain != 0 ? lz->chain : lz77_default_chain;
+    if (f->type == lz77_finder_chain) {
+        // chain[] does not need to be longer than the input:
+        size_t n = window;
+        while (n > 1 && n / 2 >= bytes) { n /= 2; }
+        f->mask  = n - 1;
+        // about 4 positions per hash bucket like lz77.h:
+        f->hash_bits = lz77_hash_bits_min;
+        while (f->hash_bits < lz77_hash_bits_max &&
+               ((size_t)1 << (f->hash_bits + 2)) < n) {
+            f->hash_bits++;
+        }
+        f->head  = (uint32_t*)calloc((size_t)1 << f->hash_bits,
+                                     sizeof(uint32_t));
+        f->chain = (uint32_t*)malloc(n * sizeof(uint32_t));
+        if (f->head == null || f->chain == null) { lz->error = ENOMEM; }
+    } else if (f->type != lz77_finder_scan) {
+        lz->error = EINVAL;
+    }
+}
+
+static void lz77_finder_fini(lz77_finder_t* f) {
+    free(f->head);
+    free(f->chain);
+    f->head  = null;
+    f->chain = null;
+}
+
+static inline void lz77_insert(lz77_finder_t* f, size_t i) {
+    if (f->type == lz77_finder_chain &&
+        i + lz77_hash_read(lz77_min_match) <= f->bytes) {
+        const uint32_t h = lz77_hash(f->data + i, lz77_min_match,
+                                     f->hash_bits);
+        f->chain[i & f->mask] = f->head[h];
+        f->head[h] = (uint32_t)(i + 1);
+    }
+}
+
+static inline size_t lz77_match_len(const uint8_t* a, const uint8_t* b,
+        size_t n) {
+    // compares 32, 16 or 8 bytes at a time; the first mismatching
+    // byte is the lowest set bit of the difference (little endian):
+    size_t k = 0;
+    #ifdef lz77_avx2
+    while (k + 32 <= n) {
+        const __m256i x = _mm256_loadu_si256((const __m256i*)(a + k));
+        const __m256i y = _mm256_loadu_si256((const __m256i*)(b + k));
+        const uint32_t e = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+        if (e != 0xFFFFFFFFu) { return k + lz77_ctz32(~e); }
+        k += 32;
+    }
+    #endif
+    #ifdef lz77_sse2
+    while (k + 16 <= n) {
+        const __m128i x = _mm_loadu_si128((const __m128i*)(a + k));
+        const __m128i y = _mm_loadu_si128((const __m128i*)(b + k));
+        const uint32_t e = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+        if (e != 0xFFFFu) { return k + lz77_ctz32(~e); }
+        k += 16;
+    }
+    #endif
+    #ifdef lz77_little_endian
+    while (k + 8 <= n) {
+        uint64_t x;
+        uint64_t y;
+        memcpy(&x, a + k, sizeof(x));
+        memcpy(&y, b + k, sizeof(y));
+        if (x != y) { return k + lz77_ctz64(x ^ y) / 8; }
+        k += 8;
+    }
+    #endif
+    while (k < n && a[k] == b[k]) { k++; }
+    return k;
+}
+
+static void lz77_find_chain(lz77_finder_t* f, size_t i,
+        size_t* len, size_t* pos) {
+    const uint8_t* d = f->data;
+    const size_t n = f->bytes - i;
+    if (n < lz77_hash_read(lz77_min_match)) { return; }
+    const uint32_t i1 = (uint32_t)(i + 1);
+    uint32_t c = f->head[lz77_hash(d + i, lz77_min_match, f->hash_bits)];
+    uint32_t depth = f->depth;
+    size_t last = 0; // distance of previous candidate
+    while (c != 0 && depth > 0) {
+        const size_t distance = (uint32_t)(i1 - c);
+        // distances must strictly grow along the chain, otherwise
+        // the entry is stale (overwritten ring slot or 4GB wrap):
+        if (distance <= last || distance >= f->window || distance > i) {
+            break;
+        }
+        const size_t j = i - distance;
+        // cheap rejection: a longer match must agree at d[*len]
+        if (d[j + *len] == d[i + *len] || *len == 0) {
+            const size_t k = lz77_match_len(d + j, d + i, n);
+            if (k > *len) {
+                *len = k;
+                *pos = distance;
+                if (k == n) { break; }
+            }
+        }
+        c = f->chain[j & f->mask];
+        last = distance;
+        depth--;
+    }
+}
+
+static void lz77_find_scan(lz77_finder_t* f, size_t i,
+        size_t* len, size_t* pos) {
+    const uint8_t* d = f->data;
+    const size_t n = f->bytes - i;
+    const size_t min_j = i >= f->window ? i - f->window + 1 : 0;
+    size_t j = i;
+    #if defined(lz77_avx2) || defined(lz77_sse2)
+    // candidates are tested 32 or 16 at a time: first 4 bytes (or 3 while
+    // no 3 byte match was found) must be equal to be extended. Loads stay
+    // below d[i + 2] so `n` >= 4 is enough for d[i + 3].
+    if (n >= 4) {
+        #ifdef lz77_avx2
+        const __m256i c0 = _mm256_set1_epi8((char)d[i + 0]);
+        const __m256i c1 = _mm256_set1_epi8((char)d[i + 1]);
+        const __m256i c2 = _mm256_set1_epi8((char)d[i + 2]);
+        const __m256i c3 = _mm256_set1_epi8((char)d[i + 3]);
+        while (j >= min_j + 32) {
+            j -= 32;
+            const uint8_t* p = d + j;
+            __m256i e = _mm256_and_si256(
+                _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), c0),
+                _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + 1)), c1));
+            e = _mm256_and_si256(e,
+                _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + 2)), c2));
+            if (*len >= 3) {
+                e = _mm256_and_si256(e,
+                    _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + 3)), c3));
+            }
+            uint32_t mask = (uint32_t)_mm256_movemask_epi8(e);
+            while (mask != 0) { // nearest (highest) candidate first
+                const uint32_t t = 31 - lz77_clz32(mask);
+                mask &= ~(1U << t);
+                const size_t k = lz77_match_len(p + t, d + i, n);
+                if (k > *len) {
+                    *len = k;
+                    *pos = i - j - t;
+                    if (k == n) { return; }
+                }
+            }
+        }
+        #endif
+        #ifdef lz77_sse2
+        const __m128i b0 = _mm_set1_epi8((char)d[i + 0]);
+        const __m128i b1 = _mm_set1_epi8((char)d[i + 1]);
+        const __m128i b2 = _mm_set1_epi8((char)d[i + 2]);
+        const __m128i b3 = _mm_set1_epi8((char)d[i + 3]);
+        while (j >= min_j + 16) {
+            j -= 16;
+            const uint8_t* p = d + j;
+            __m128i e = _mm_and_si128(
+                _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), b0),
+                _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + 1)), b1));
+            e = _mm_and_si128(e,
+                _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + 2)), b2));
+            if (*len >= 3) {
+                e = _mm_and_si128(e,
+                    _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + 3)), b3));
+            }
+            uint32_t mask = (uint32_t)_mm_movemask_epi8(e);
+            while (mask != 0) {
+                const uint32_t t = 31 - lz77_clz32(mask);
+                mask &= ~(1U << t);
+                const size_t k = lz77_match_len(p + t, d + i, n);
+                if (k > *len) {
+                    *len = k;
+                    *pos = i - j - t;
+                    if (k == n) { return; }
+                }
+            }
+        }
+        #endif
+    }
+    #endif
+    while (j > min_j) {
+        j--;
+        lz77_assert(0 < i - j && i - j < f->window);
+        const size_t k = lz77_match_len(d + j, d + i, n);
+        if (k > *len) {
+            *len = k;
+            *pos = i - j;
+            if (k == n) { break; }
+        }
+    }
+}
+
+// Finds longest match for data[i] in the window and inserts position `i`
+// into the finder. The match is returned in `len` and `pos` (distance)
+// with len == 0 if nothing was found.
+
+static void lz77_find(lz77_finder_t* f, size_t i, size_t* len, size_t* pos) {
+    *len = 0;
+    *pos = 0;
+    if (f->type == lz77_finder_chain) {
+        lz77_find_chain(f, i, len, pos);
+    } else {
+        lz77_find_scan(f, i, len, pos);
+    }
+    lz77_insert(f, i);
+}
+
 static void lz77_compress(lz77_t* lz, const uint8_t* data, size_t bytes,
         uint8_t window_bits) {
     lz77_if_error_return(lz);
@@ -246,53 +590,37 @@ static void lz77_compress(lz77_t* lz, const uint8_t* data, size_t bytes,
     lz77_binheap_init(&lz->bh_txt, 0x80); // ascii text
     lz77_binheap_init(&lz->bh_pos, (int32_t)window);
     lz77_binheap_init(&lz->bh_len, (int32_t)window);
+    lz77_finder_t f;
+    lz77_finder_init(lz, &f, data, bytes, window);
+    if (lz->error) { lz77_finder_fini(&f); return; }
     uint64_t b64 = 0;
     uint32_t bp = 0;
     size_t i = 0;
-    while (i < bytes) {
+    while (i < bytes && lz->error == 0) {
         // length and position of longest matching sequence
         size_t len = 0;
         size_t pos = 0;
-        if (i >= 1) {
-            size_t j = i - 1;
-            size_t min_j = i > window ? i - window : 0;
-            while (j > min_j) {
-                rt_assert((i - j) < window);
-                const size_t n = bytes - i;
-                size_t k = 0;
-                while (k < n && data[j + k] == data[i + k]) {
-                    k++;
-                }
-                if (k > len) {
-                    len = k;
-                    pos = i - j;
-                }
-                j--;
-            }
-        }
-        if (len > 2) {
+        lz77_find(&f, i, &len, &pos);
+        if (len >= lz77_min_match) {
 //lz77_println("i: %lld pos: %lld len: %lld ->", i, pos, len);
 //lz77_println("i: %lld pos: %lld len: %lld", i, lz->bh_pos.sx[pos], lz->bh_len.sx[len]);
             rt_assert(0 < pos && pos < window);
             rt_assert(0 < len);
             lz77_write_bits(lz, &b64, &bp, 0b11, 2); // flags
-            lz77_if_error_return(lz);
             lz77_write_number(lz, &b64, &bp, lz->bh_pos.sx[pos], base);
             lz77_binheap_inc_freq(&lz->bh_pos, (int32_t)pos);
-            lz77_if_error_return(lz);
             lz77_write_bit(lz, &b64, &bp, len >= window); // flag: long len
-            lz77_if_error_return(lz);
             if (len >= window) {
                 lz77_write_number(lz, &b64, &bp, len, base);
             } else {
                 lz77_write_number(lz, &b64, &bp, lz->bh_len.sx[len], base);
                 lz77_binheap_inc_freq(&lz->bh_len, (int32_t)len);
             }
-            lz77_if_error_return(lz);
 //          lz77_histogram_pos_len(pos, len);
             if (len < window) {
                 lz77_histogram_pos_len(lz->bh_pos.sx[pos], lz->bh_len.sx[len]);
             }
+            for (size_t k = 1; k < len; k++) { lz77_insert(&f, i + k); }
             i += len;
         } else {
             const uint8_t b = data[i];
@@ -300,59 +628,80 @@ static void lz77_compress(lz77_t* lz, const uint8_t* data, size_t bytes,
             // European texts are predominantly spaces and small ASCII letters:
             if (b < 0x80) {
                 lz77_write_bit(lz, &b64, &bp, 0); // flags
-                lz77_if_error_return(lz);
                 // ASCII byte < 0x80 with 8th bit set to `0`
                 const uint8_t bh = (uint8_t)lz->bh_txt.sx[b];
 //              lz77_write_bits(lz, &b64, &bp, bh, 7);
                 lz77_write_number(lz, &b64, &bp, bh, 2);
                 lz77_binheap_inc_freq(&lz->bh_txt, b);
-                lz77_if_error_return(lz);
             } else {
                 lz77_write_bit(lz, &b64, &bp, 1); // flag: 1
                 lz77_write_bit(lz, &b64, &bp, 0); // flag: 0
-                lz77_if_error_return(lz);
                 // only 7 bit because 8th bit is `1`
                 const uint8_t bh = (uint8_t)lz->bh_txt.sx[b & 0x7F];
 //              lz77_write_bits(lz, &b64, &bp, bh, 7);
                 lz77_write_number(lz, &b64, &bp, bh, 2);
                 lz77_binheap_inc_freq(&lz->bh_txt, b & 0x7F);
-                lz77_if_error_return(lz);
             }
             i++;
         }
     }
+    lz77_finder_fini(&f);
     lz77_flush(lz, b64, bp);
     lz77_dump_histograms();
 }
 
-static inline uint64_t lz77_read_bit(lz77_t* lz, uint64_t* b64, uint32_t* bp) {
-    if (*bp == 0) { *b64 = lz->read(lz); }
-    uint64_t bit = (*b64 >> *bp) & 1;
-    *bp = *bp == 63 ? 0 : *bp + 1;
-    return bit;
+// Bit reader: `b64` holds the next bits of the stream least significant
+// first, `hi` the bits that follow them and `count` is the number of
+// valid bits in both (up to 120). lz77_peek() reads a word only when it
+// needs more bits than buffered, exactly where the writer crossed into
+// it, so nothing past the end of compressed data is ever requested.
+
+typedef struct lz77_bits_s {
+    uint64_t b64;
+    uint64_t hi;
+    uint32_t count;
+} lz77_bits_t;
+
+static inline uint64_t lz77_peek(lz77_t* lz, lz77_bits_t* r, uint32_t n) {
+    rt_assert(0 < n && n <= 57);
+    if (r->count < n) { // all buffered bits are in b64 and hi == 0
+        const uint64_t w = lz->read(lz);
+        r->b64 |= w << r->count;
+        r->hi = r->count == 0 ? 0 : w >> (64 - r->count);
+        r->count += 64;
+    }
+    return r->b64 & (((uint64_t)1 << n) - 1);
 }
 
-static inline uint64_t lz77_read_bits(lz77_t* lz, uint64_t* b64,
-        uint32_t* bp, uint32_t n) {
-    rt_assert(n <= 64);
-    uint64_t bits = 0;
-    for (uint32_t i = 0; i < n && lz->error == 0; i++) {
-        uint64_t bit = lz77_read_bit(lz, b64, bp);
-        bits |= bit << i;
-    }
+static inline void lz77_consume(lz77_bits_t* r, uint32_t n) {
+    rt_assert(0 < n && n <= 57 && n <= r->count);
+    r->b64 = (r->b64 >> n) | (r->hi << (64 - n));
+    r->hi >>= n;
+    r->count -= n;
+}
+
+static inline uint64_t lz77_read_bits(lz77_t* lz, lz77_bits_t* r,
+        uint32_t n) {
+    const uint64_t bits = lz77_peek(lz, r, n);
+    lz77_consume(r, n);
     return bits;
 }
 
-static inline uint64_t lz77_read_number(lz77_t* lz, uint64_t* b64,
-        uint32_t* bp, uint8_t base) {
+static inline uint64_t lz77_read_bit(lz77_t* lz, lz77_bits_t* r) {
+    return lz77_read_bits(lz, r, 1);
+}
+
+static inline uint64_t lz77_read_number(lz77_t* lz, lz77_bits_t* r,
+        uint8_t base) {
+    const uint64_t mask = ((uint64_t)1 << base) - 1;
     uint64_t bits = 0;
-    uint64_t bit = 0;
     uint32_t shift = 0;
-    do {
-        bits |= (lz77_read_bits(lz, b64, bp, base) << shift);
+    for (;;) { // `base` bits and continue bit per group
+        const uint64_t group = lz77_read_bits(lz, r, base + 1);
+        bits |= (group & mask) << shift;
+        if ((group >> base) == 0 || lz->error != 0) { break; }
         shift += base;
-        bit = lz77_read_bit(lz, b64, bp);
-    } while (bit && lz->error == 0);
+    }
     return bits;
 }
 
@@ -366,8 +715,6 @@ static void lz77_read_header(lz77_t* lz, size_t *bytes, uint8_t *window_bits) {
 static void lz77_decompress(lz77_t* lz, uint8_t* data, size_t bytes,
         uint8_t window_bits) {
     lz77_if_error_return(lz);
-    uint64_t b64 = 0;
-    uint32_t bp = 0;
     if (window_bits < 10 || window_bits > 20) { lz77_return_invalid(lz); }
     const size_t window = ((size_t)1U) << window_bits;
 //  const uint8_t base = (window_bits - 4) / 2;
@@ -376,25 +723,26 @@ static void lz77_decompress(lz77_t* lz, uint8_t* data, size_t bytes,
     lz77_binheap_init(&lz->bh_pos, (int32_t)window);
     lz77_binheap_init(&lz->bh_len, (int32_t)window);
     size_t i = 0; // output data[i]
+    lz77_bits_t r = { 0 };
     while (i < bytes) {
-        uint64_t bit0 = lz77_read_bit(lz, &b64, &bp);
+        uint64_t bit0 = lz77_read_bit(lz, &r);
         lz77_if_error_return(lz);
         if (bit0) {
-            uint64_t bit1 = lz77_read_bit(lz, &b64, &bp);
+            uint64_t bit1 = lz77_read_bit(lz, &r);
             lz77_if_error_return(lz);
             if (bit1) {
-                uint64_t pos = lz77_read_number(lz, &b64, &bp, base);
+                uint64_t pos = lz77_read_number(lz, &r, base);
                 lz77_if_error_return(lz);
                 pos = lz->bh_pos.ns[pos];
                 lz77_binheap_inc_freq(&lz->bh_pos, (int32_t)pos);
-                uint64_t long_len = lz77_read_bit(lz, &b64, &bp);
+                uint64_t long_len = lz77_read_bit(lz, &r);
                 lz77_if_error_return(lz);
                 uint64_t len = 0;
                 if (long_len) {
-                    len = lz77_read_number(lz, &b64, &bp, base);
+                    len = lz77_read_number(lz, &r, base);
                     lz77_if_error_return(lz);
                 } else {
-                    len = lz77_read_number(lz, &b64, &bp, base);
+                    len = lz77_read_number(lz, &r, base);
                     lz77_if_error_return(lz);
                     len = lz->bh_len.ns[len];
                     lz77_binheap_inc_freq(&lz->bh_len, (int32_t)len);
@@ -410,8 +758,8 @@ static void lz77_decompress(lz77_t* lz, uint8_t* data, size_t bytes,
                 const size_t n = i + (size_t)len;
                 while (i < n) { data[i] = s[i]; i++; }
             } else { // byte >= 0x80
-//              uint8_t b = (uint8_t)lz77_read_bits(lz, &b64, &bp, 7);
-                uint8_t b = (uint8_t)lz77_read_number(lz, &b64, &bp, 2);
+//              uint8_t b = (uint8_t)lz77_read_bits(lz, &r, 7);
+                uint8_t b = (uint8_t)lz77_read_number(lz, &r, 2);
                 lz77_if_error_return(lz);
                 uint8_t s = (uint8_t)lz->bh_txt.ns[b]; // symbol
                 data[i] = 0x80 | s;
@@ -420,8 +768,8 @@ static void lz77_decompress(lz77_t* lz, uint8_t* data, size_t bytes,
                 i++;
             }
         } else { // ASCII byte < 0x80
-//          uint8_t b = (uint8_t)lz77_read_bits(lz, &b64, &bp, 7);
-            uint8_t b = (uint8_t)lz77_read_number(lz, &b64, &bp, 2);
+//          uint8_t b = (uint8_t)lz77_read_bits(lz, &r, 7);
+            uint8_t b = (uint8_t)lz77_read_number(lz, &r, 2);
             lz77_if_error_return(lz);
             uint8_t s = (uint8_t)lz->bh_txt.ns[b]; // symbol
 //lz77_println("i: %lld byte: %08X %c", i, s, s);
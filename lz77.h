@@ -3,12 +3,58 @@
 
 #include <errno.h>
 #include <math.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 // Naive LZ77 implementation inspired by CharGPT discussion
 // and my personal passion to compressors in 198x
 
 typedef struct lz77_s lz77_t;
+typedef struct lz77_stream_s lz77_stream_t;
+
+enum { // match finders:
+    lz77_finder_level = 0, // chosen by compression level
+    lz77_finder_chain = 1, // hash chains
+    lz77_finder_scan  = 2, // exhaustive scan of the whole window (slow)
+    lz77_finder_tree  = 3, // binary trees (LZMA BT style), best ratio
+    lz77_finder_sa    = 4, // suffix array of the whole input, longest match
+};
+
+enum { // parsers:
+    lz77_parse_level   = 0, // chosen by compression level
+    lz77_parse_greedy  = 1, // longest match at each position
+    lz77_parse_lazy    = 2, // literal first if next position matches better
+    lz77_parse_lazy2   = 3, // ... or the one after it
+    lz77_parse_optimal = 4, // minimum number of bits (slow)
+};
+
+enum { // window_bits:
+    lz77_window_bits_min = 10, // 1KB
+    lz77_window_bits_max = 27  // 128MB
+};
+
+enum { // minimum match length:
+    lz77_min_match_auto = 1, // chosen per block from sampled statistics
+    lz77_min_match_min  = 3,
+    lz77_min_match_max  = 8
+};
+
+enum { // coding of match distances and lengths:
+    lz77_coding_varint = 0, // groups of bits each with a continue bit
+    lz77_coding_bucket = 1  // log2 bucket in unary and raw extra bits
+};
+
+enum { // span I/O:
+    lz77_span_bytes = 64 * 1024 // compressed output handed to write_span()
+};
+
+enum { // compression levels:
+    lz77_level_fastest = 1, // LZ4 class speed
+    lz77_level_default = 5,
+    lz77_level_best    = 9  // binary tree finder and optimal parse
+};
 
 typedef struct lz77_s {
     // `that` see: https://gist.github.com/leok7v/8d118985d3236b0069d419166f4111cf
@@ -17,11 +63,41 @@ typedef struct lz77_s {
     // caller supplied read()/write() must error via .error field
     uint64_t (*read)(lz77_t*); //  reads 64 bits
     void     (*write)(lz77_t*, uint64_t b64); // writes 64 bits
+    // span I/O is used instead of read()/write() when not null:
+    // read_span() returns the next span of compressed input (zero `bytes`
+    // at the end of it) that must stay valid until the following call;
+    // write_span() takes up to lz77_span_bytes of compressed output.
+    const uint8_t* (*read_span)(lz77_t*, size_t* bytes);
+    void (*write_span)(lz77_t*, const uint8_t* data, size_t bytes);
     uint64_t written;
+    // compress() parameters, zero means default for the `level`:
+    uint8_t  level;  // [1..9] lz77_level_fastest .. lz77_level_best
+    uint8_t  finder; // lz77_finder_*
+    uint8_t  parse;  // lz77_parse_*
+    uint32_t chain;  // maximum number of chain or tree candidates to check
+    uint32_t nice;   // match length that is good enough to stop search
+    uint8_t  min_match; // [3..8] shortest match or lz77_min_match_auto
+    bool     long_distance; // also find duplicates of lz77_ldm_min bytes
+                            // or more anywhere in the input (pre-pass)
+    uint8_t  coding; // lz77_coding_* recorded in the header, read_header()
+                     // sets it for decompress()
+    bool     legacy; // stream written before repeat offsets (distances
+                     // coded as is), read_header() sets it for decompress()
+    // decompress() parameters:
+    uint8_t  window_limit; // maximum window_bits accepted, zero means
+                           // lz77_window_bits_max
+    // internal state of span and memory I/O:
+    const uint8_t* span;  // not yet consumed part of the last read_span()
+    size_t   span_bytes;
+    uint8_t* out;         // output words not written yet or destination
+    size_t   out_bytes;   // of compress_to_buffer()
+    size_t   out_capacity;
+    lz77_stream_t* stream; // decompress_open() .. decompress_close()
 } lz77_t;
 
 typedef struct lz77_if {
-    // `window_bits` is a log2 of window size in bytes must be in range [10..20]
+    // `window_bits` is a log2 of window size in bytes must be in range
+    // [lz77_window_bits_min..lz77_window_bits_max]
     void (*write_header)(lz77_t* lz77, size_t bytes, uint8_t window_bits);
     void (*compress)(lz77_t* lz77, const uint8_t* data, size_t bytes,
                      uint8_t window_bits);
@@ -30,6 +106,29 @@ typedef struct lz77_if {
                        uint8_t window_bits);
     // Writing and reading envelope of source data `bytes` and
     // `window_bits` is caller's responsibility.
+    // Memory to memory entry points need no callbacks. Parameters are
+    // taken from `lz` (null for defaults), the output includes the header
+    // and errors are returned (0 or errno, ENOBUFS if `capacity` is too
+    // small) instead of being left in the sticky .error field.
+    // compress_bound() is the largest compress_to_buffer() output.
+    size_t  (*compress_bound)(size_t bytes, uint8_t window_bits);
+    errno_t (*compress_to_buffer)(const lz77_t* lz, const uint8_t* data,
+                size_t bytes, uint8_t window_bits,
+                uint8_t* out, size_t capacity, size_t* written);
+    // `bytes` is the decompressed size (also when it exceeds `capacity`)
+    errno_t (*decompress_from_buffer)(const lz77_t* lz, const uint8_t* in,
+                size_t in_bytes, uint8_t* data, size_t capacity,
+                size_t* bytes);
+    // Streaming decompression keeps a ring buffer of two windows instead
+    // of the whole output. After read_header() decompress_open() sets up
+    // the decoder, each decompress_read() returns up to `capacity` bytes
+    // of the next output (fewer only at the end of it or on error, see
+    // .error) and decompress_close() frees the decoder. Streams that were
+    // compressed with .long_distance may fail with ENOTSUP.
+    void   (*decompress_open)(lz77_t* lz77, size_t bytes,
+                              uint8_t window_bits);
+    size_t (*decompress_read)(lz77_t* lz77, uint8_t* data, size_t capacity);
+    void   (*decompress_close)(lz77_t* lz77);
 } lz77_if;
 
 extern lz77_if lz77;
@@ -57,6 +156,96 @@ extern lz77_if lz77;
     return;                                             \
 } while (0)
 
+enum {
+    lz77_far_base      = 16, // bit groups of long distance match numbers
+    lz77_reps          = 3   // repeat offsets remembered by both sides
+};
+
+#if defined(__AVX2__)
+#define lz77_avx2
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define lz77_sse2
+#endif
+
+#if defined(lz77_sse2) || defined(lz77_avx2)
+#include <immintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#if (defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86) || \
+     defined(_M_ARM64))) || (defined(__BYTE_ORDER__) && \
+     __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define lz77_little_endian
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define lz77_prefetch(p) __builtin_prefetch(p)
+#elif defined(lz77_sse2)
+#define lz77_prefetch(p) _mm_prefetch((const char*)(p), _MM_HINT_T0)
+#else
+#define lz77_prefetch(p) do { } while (0)
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define lz77_force_inline inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define lz77_force_inline __forceinline
+#else
+#define lz77_force_inline inline
+#endif
+
+static inline uint32_t lz77_ctz32(uint32_t x) { // x != 0
+    #ifdef _MSC_VER
+        unsigned long i;
+        _BitScanForward(&i, x);
+        return (uint32_t)i;
+    #else
+        return (uint32_t)__builtin_ctz(x);
+    #endif
+}
+
+static inline uint32_t lz77_ctz64(uint64_t x) { // x != 0
+    #if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+        unsigned long i;
+        _BitScanForward64(&i, x);
+        return (uint32_t)i;
+    #elif defined(_MSC_VER)
+        const uint32_t lo = (uint32_t)x;
+        return lo != 0 ? lz77_ctz32(lo) : 32 + lz77_ctz32((uint32_t)(x >> 32));
+    #else
+        return (uint32_t)__builtin_ctzll(x);
+    #endif
+}
+
+static inline uint32_t lz77_clz32(uint32_t x) { // x != 0
+    #ifdef _MSC_VER
+        unsigned long i;
+        _BitScanReverse(&i, x);
+        return 31 - (uint32_t)i;
+    #else
+        return (uint32_t)__builtin_clz(x);
+    #endif
+}
+
+static inline uint32_t lz77_log2(uint64_t x) { // x != 0, floor(log2(x))
+    #if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+        unsigned long i;
+        _BitScanReverse64(&i, x);
+        return (uint32_t)i;
+    #elif defined(_MSC_VER)
+        const uint32_t hi = (uint32_t)(x >> 32);
+        return hi != 0 ? 63 - lz77_clz32(hi) : 31 - lz77_clz32((uint32_t)x);
+    #else
+        return 63 - (uint32_t)__builtin_clzll(x);
+    #endif
+}
+
 #ifdef lz77_historgram
 
 static inline uint32_t lz77_bit_count(size_t v) {
@@ -68,15 +257,6 @@ static inline uint32_t lz77_bit_count(size_t v) {
 static size_t lz77_hist_len[64];
 static size_t lz77_hist_pos[64];
 
-#define lz77_init_histograms() do {                     \
-    memset(lz77_hist_pos, 0x00, sizeof(lz77_hist_pos)); \
-    memset(lz77_hist_len, 0x00, sizeof(lz77_hist_len)); \
-} while (0)
-
-#define  lz77_histogram_pos_len(pos, len) do {          \
-    lz77_hist_pos[lz77_bit_count(pos)]++;               \
-    lz77_hist_len[lz77_bit_count(len)]++;               \
-} while (0)
 
 #define lz77_dump_histograms() do {                                 \
     lz77_println("Histogram log2(len):");                           \
@@ -91,62 +271,14 @@ static size_t lz77_hist_pos[64];
             lz77_println("pos[%d]: %lld", i_, lz77_hist_pos[i_]);   \
         }                                                           \
     }                                                               \
+    lz77_println("bits len: %.2f pos: %.2f words: %d "              \
+                 "max chain: %d max bytes: %d #len: %d #pos: %d",   \
+        lz77_entropy(len_freq, (int32_t)rt_countof(len_freq)),      \
+        lz77_entropy(pos_freq, (int32_t)rt_countof(pos_freq)),      \
+        map.entries, map.max_chain, map.max_bytes,                  \
+        lens.entries, poss.entries);                                \
 } while (0)
 
-#else
-
-#define lz77_init_histograms()           do { } while (0)
-#define lz77_histogram_pos_len(pos, bytes) do { } while (0)
-#define lz77_dump_histograms()           do { } while (0)
-
-#endif
-
-static inline void lz77_write_bit(lz77_t* lz, uint64_t* b64,
-        uint32_t* bp, uint64_t bit) {
-    if (*bp == 64 && lz->error == 0) {
-        lz->write(lz, *b64);
-        *b64 = 0;
-        *bp = 0;
-        if (lz->error == 0) { lz->written += 8; }
-    }
-    *b64 |= bit << *bp;
-    (*bp)++;
-}
-
-static inline void lz77_write_bits(lz77_t* lz, uint64_t* b64,
-        uint32_t* bp, uint64_t bits, uint32_t n) {
-    rt_assert(n <= 64);
-    while (n > 0) {
-        lz77_write_bit(lz, b64, bp, bits & 1);
-        bits >>= 1;
-        n--;
-    }
-}
-
-static inline void lz77_write_number(lz77_t* lz, uint64_t* b64,
-        uint32_t* bp, uint64_t bits, uint8_t base) {
-    do {
-        lz77_write_bits(lz, b64, bp, bits, base);
-        bits >>= base;
-        lz77_write_bit(lz, b64, bp, bits != 0); // continue bit
-    } while (bits != 0);
-}
-
-static inline void lz77_flush(lz77_t* lz, uint64_t b64, uint32_t bp) {
-    if (bp > 0 && lz->error == 0) {
-        lz->write(lz, b64);
-        if (lz->error == 0) { lz->written += 8; }
-    }
-}
-
-static void lz77_write_header(lz77_t* lz, size_t bytes, uint8_t window_bits) {
-    lz77_if_error_return(lz);
-    if (window_bits < 10 || window_bits > 20) { lz77_return_invalid(lz); }
-    lz->write(lz, (uint64_t)bytes);
-    lz77_if_error_return(lz);
-    lz->write(lz, (uint64_t)window_bits);
-}
-
 typedef uint8_t map_entry_t[256]; // data[0] number of bytes [2..255]
 
 typedef struct {
@@ -259,178 +391,2145 @@ static double lz77_entropy(uint64_t freq[], int32_t n) {
     return -aha_entropy;
 }
 
-static void lz77_compress(lz77_t* lz, const uint8_t* data, size_t bytes,
-        uint8_t window_bits) {
-memset(pos_freq, 0x00, sizeof(pos_freq));
-memset(len_freq, 0x00, sizeof(pos_freq));
-map_init(&map);
-map_init(&lens);
-map_init(&poss);
-    lz77_if_error_return(lz);
-    if (window_bits < 10 || window_bits > 20) { lz77_return_invalid(lz); }
-    lz77_init_histograms();
-    const size_t window = ((size_t)1U) << window_bits;
-    const uint8_t base = (window_bits - 4) / 2;
-    uint64_t b64 = 0;
-    uint32_t bp = 0;
-    size_t i = 0;
-    while (i < bytes) {
-        // bytes and position of longest matching sequence
-        size_t len = 0;
-        size_t pos = 0;
-        if (i >= 1) {
-            size_t j = i - 1;
-            size_t min_j = i > window ? i - window : 0;
-            while (j > min_j) {
-                rt_assert((i - j) < window);
-                const size_t n = bytes - i;
-                size_t k = 0;
-                while (k < n && data[j + k] == data[i + k]) {
-                    k++;
-                }
-                if (k > len) {
-                    len = k;
-                    pos = i - j;
-                }
-                j--;
-            }
-        }
-        if (len > 2) {
-            rt_assert(0 < pos && pos < window);
-            rt_assert(0 < len);
-            lz77_write_bits(lz, &b64, &bp, 0b11, 2); // flags
-            lz77_if_error_return(lz);
-            lz77_write_number(lz, &b64, &bp, pos, base);
-            lz77_if_error_return(lz);
-            lz77_write_number(lz, &b64, &bp, len, base);
-            lz77_if_error_return(lz);
-            lz77_histogram_pos_len(pos, len);
-if (len < window) { len_freq[len]++; }
-if (pos < window) { pos_freq[pos]++; }
-// lz77_println("\"%.*s\"", bytes, &data[i]);
-if (len <= 255) {
-    map_put(&map, &data[i], (uint8_t)len);
-}
-map_put(&lens, (uint8_t*)&len, (uint8_t)sizeof(len));
-map_put(&poss, (uint8_t*)&pos, (uint8_t)sizeof(pos));
-            i += len;
+#define lz77_init_histograms() do {                     \
+    memset(lz77_hist_pos, 0x00, sizeof(lz77_hist_pos)); \
+    memset(lz77_hist_len, 0x00, sizeof(lz77_hist_len)); \
+    memset(pos_freq, 0x00, sizeof(pos_freq));           \
+    memset(len_freq, 0x00, sizeof(len_freq));           \
+    map_init(&map);                                     \
+    map_init(&lens);                                    \
+    map_init(&poss);                                    \
+} while (0)
+
+#define lz77_histogram_pos_len(pos, len) do {           \
+    lz77_hist_pos[lz77_bit_count(pos)]++;               \
+    lz77_hist_len[lz77_bit_count(len)]++;               \
+    if (len < rt_countof(len_freq)) { len_freq[len]++; } \
+    if (pos < rt_countof(pos_freq)) { pos_freq[pos]++; } \
+    map_put(&lens, (uint8_t*)&len, (uint8_t)sizeof(len)); \
+    map_put(&poss, (uint8_t*)&pos, (uint8_t)sizeof(pos)); \
+} while (0)
+
+#define lz77_histogram_word(data, len) do {             \
+    if (len <= 255) { map_put(&map, data, (uint8_t)len); } \
+} while (0)
+
+#else
+
+#define lz77_init_histograms()           do { } while (0)
+#define lz77_histogram_pos_len(pos, len) do { } while (0)
+#define lz77_histogram_word(data, len)   do { } while (0)
+#define lz77_dump_histograms()           do { } while (0)
+
+#endif
+
+// Compressed output is handed over in spans. With only the 64 bit
+// write() callback supplied it is called for each word of the span.
+
+static void lz77_write_span(lz77_t* lz, const uint8_t* data, size_t bytes) {
+    if (lz->error == 0 && bytes > 0) {
+        if (lz->write_span != null) {
+            lz->write_span(lz, data, bytes);
         } else {
-            const uint8_t b = data[i];
-            // European texts are predominantly spaces and small ASCII letters:
-            if (b < 0x80) {
-                lz77_write_bit(lz, &b64, &bp, 0); // flags
-                lz77_if_error_return(lz);
-                // ASCII byte < 0x80 with 8th bit set to `0`
-                lz77_write_bits(lz, &b64, &bp, b, 7);
-                lz77_if_error_return(lz);
-            } else {
-                lz77_write_bit(lz, &b64, &bp, 1); // flag: 1
-                lz77_write_bit(lz, &b64, &bp, 0); // flag: 0
-                lz77_if_error_return(lz);
-                // only 7 bit because 8th bit is `1`
-                lz77_write_bits(lz, &b64, &bp, b, 7);
-                lz77_if_error_return(lz);
+            for (size_t k = 0; k < bytes && lz->error == 0; k += 8) {
+                uint64_t w;
+                memcpy(&w, data + k, sizeof(w));
+                lz->write(lz, w);
             }
-            i++;
         }
     }
-    lz77_flush(lz, b64, bp);
-    lz77_dump_histograms();
-    double len_bits = lz77_entropy(len_freq, (int32_t)window);
-    double pos_bits = lz77_entropy(pos_freq, (int32_t)window);
-    lz77_println("bits len: %.2f pos: %.2f words: %d "
-                 "max chain: %d max bytes: %d #len: %d #pos: %d",
-        len_bits, pos_bits, map.entries, map.max_chain, map.max_bytes,
-        lens.entries, poss.entries);
 }
 
-static inline uint64_t lz77_read_bit(lz77_t* lz, uint64_t* b64, uint32_t* bp) {
-    if (*bp == 0) { *b64 = lz->read(lz); }
-    uint64_t bit = (*b64 >> *bp) & 1;
-    *bp = *bp == 63 ? 0 : *bp + 1;
-    return bit;
+// Without write callbacks out[] is the caller's destination buffer and
+// running out of it is an error.
+
+static void lz77_write_out(lz77_t* lz) { // out[] to `written` bytes
+    if (lz->write_span != null || lz->write != null) {
+        lz77_write_span(lz, lz->out, lz->out_bytes);
+    }
+    if (lz->error == 0) { lz->written += lz->out_bytes; }
+    lz->out_bytes = 0;
 }
 
-static inline uint64_t lz77_read_bits(lz77_t* lz, uint64_t* b64,
-        uint32_t* bp, uint32_t n) {
-    rt_assert(n <= 64);
-    uint64_t bits = 0;
-    for (uint32_t i = 0; i < n && lz->error == 0; i++) {
-        uint64_t bit = lz77_read_bit(lz, b64, bp);
-        bits |= bit << i;
+static inline void lz77_write_word(lz77_t* lz, uint64_t w) {
+    if (lz->out_bytes == lz->out_capacity) {
+        if (lz->write_span == null && lz->write == null) {
+            if (lz->error == 0) { lz->error = ENOBUFS; }
+            return;
+        }
+        lz77_write_out(lz);
     }
-    return bits;
+    memcpy(lz->out + lz->out_bytes, &w, sizeof(w));
+    lz->out_bytes += sizeof(w);
 }
 
-static inline uint64_t lz77_read_number(lz77_t* lz, uint64_t* b64,
-        uint32_t* bp, uint8_t base) {
-    uint64_t bits = 0;
-    uint64_t bit = 0;
-    uint32_t shift = 0;
-    do {
-        bits |= (lz77_read_bits(lz, b64, bp, base) << shift);
-        shift += base;
-        bit = lz77_read_bit(lz, b64, bp);
-    } while (bit && lz->error == 0);
+// Bits are appended least significant first into `b64`, `bp` bits are
+// in use. Whole 64 bit words go to the output span as soon as they fill
+// up and lz->error is only checked when the span is written.
+
+static inline void lz77_write_bits(lz77_t* lz, uint64_t* b64,
+        uint32_t* bp, uint64_t bits, uint32_t n) {
+    rt_assert(n <= 57 && *bp < 64);
+    bits &= ((uint64_t)1 << n) - 1;
+    *b64 |= bits << *bp;
+    *bp += n;
+    if (*bp >= 64) {
+        lz77_write_word(lz, *b64);
+        *bp -= 64;
+        *b64 = bits >> (n - *bp);
+    }
+}
+
+// `base` bits of the number followed by continue bit per group
+
+static inline void lz77_write_number(lz77_t* lz, uint64_t* b64,
+        uint32_t* bp, uint64_t bits, uint8_t base) {
+    const uint64_t mask = ((uint64_t)1 << base) - 1;
+    while (bits > mask) {
+        lz77_write_bits(lz, b64, bp, (bits & mask) | (mask + 1), base + 1);
+        bits >>= base;
+    }
+    lz77_write_bits(lz, b64, bp, bits, base + 1);
+}
+
+// Order `k` Exp-Golomb code (lz77_coding_bucket): x = v + 2^k falls in
+// bucket n = log2(x) >= k written as n - k zero bits and a one followed
+// by the n low bits of x. Small values cost k + 1 bits and every
+// doubling past 2^k costs two more bits.
+
+static inline void lz77_write_bucket(lz77_t* lz, uint64_t* b64,
+        uint32_t* bp, uint64_t v, uint8_t k) {
+    const uint64_t x = v + ((uint64_t)1 << k);
+    const uint32_t n = lz77_log2(x);
+    lz77_write_bits(lz, b64, bp, (uint64_t)1 << (n - k), n - k + 1);
+    if (n > 0) { lz77_write_bits(lz, b64, bp, x, n); }
+}
+
+static inline void lz77_flush(lz77_t* lz, uint64_t b64, uint32_t bp) {
+    if (bp > 0) { lz77_write_word(lz, b64); }
+    lz77_write_out(lz);
+}
+
+static inline void lz77_write_literal(lz77_t* lz, uint64_t* b64,
+        uint32_t* bp, uint8_t b) {
+    // European texts are predominantly spaces and small ASCII letters:
+    if (b < 0x80) { // flag `0` and 7 bits of ASCII byte < 0x80
+        lz77_write_bits(lz, b64, bp, (uint64_t)b << 1, 8);
+    } else { // flags `1` `0` and only 7 bits because 8th bit is `1`
+        lz77_write_bits(lz, b64, bp, ((uint64_t)(b & 0x7F) << 2) | 0b01, 9);
+    }
+}
+
+// Repeat offsets: distances of the last lz77_reps matches, most recent
+// first. A match at one of them is coded as its index + 1 instead of the
+// distance. Any other distance is coded as pos + lz77_reps and 0 stands
+// for a long distance match (see lz77_write_far()).
+
+static const size_t lz77_rep_start[lz77_reps] = { 1, 4, 8 };
+
+static inline uint64_t lz77_match_code(const size_t* rep, size_t pos) {
+    for (uint32_t k = 0; k < lz77_reps; k++) {
+        if (rep[k] == pos) { return k + 1; }
+    }
+    return (uint64_t)pos + lz77_reps;
+}
+
+static inline void lz77_rep_update(size_t* rep, size_t pos) {
+    uint32_t k = 0;
+    while (k < lz77_reps - 1 && rep[k] != pos) { k++; }
+    while (k > 0) { rep[k] = rep[k - 1]; k--; }
+    rep[0] = pos;
+}
+
+// Match codes and lengths are written with `base` = (window_bits - 4) / 2
+// bit groups or as Exp-Golomb codes of orders that fit their typical
+// distribution: distances spread over about the square root of the
+// window and lengths cluster just above the minimum match.
+
+typedef struct lz77_code_s {
+    uint8_t coding; // lz77_coding_*
+    uint8_t base;   // bits per group of lz77_coding_varint
+    uint8_t pos_k;  // Exp-Golomb order of match codes
+    uint8_t len_k;  // Exp-Golomb order of lengths
+    uint8_t reps;   // lz77_reps or 0 for legacy streams
+} lz77_code_t;
+
+static inline lz77_code_t lz77_code(uint8_t coding, uint8_t window_bits) {
+    const lz77_code_t c = {
+        .coding = coding,
+        .base   = (uint8_t)((window_bits - 4) / 2),
+        .pos_k  = (uint8_t)((window_bits + 2) / 2),
+        .len_k  = 3,
+        .reps   = lz77_reps
+    };
+    return c;
+}
+
+static inline void lz77_write_match(lz77_t* lz, uint64_t* b64,
+        uint32_t* bp, size_t* rep, size_t pos, size_t len, lz77_code_t c) {
+    lz77_write_bits(lz, b64, bp, 0b11, 2); // flags
+    if (c.coding == lz77_coding_bucket) {
+        lz77_write_bucket(lz, b64, bp, lz77_match_code(rep, pos), c.pos_k);
+        lz77_write_bucket(lz, b64, bp, len, c.len_k);
+    } else {
+        lz77_write_number(lz, b64, bp, lz77_match_code(rep, pos), c.base);
+        lz77_write_number(lz, b64, bp, len, c.base);
+    }
+    lz77_rep_update(rep, pos);
+}
+
+// Long distance match is a match with code 0 (never used otherwise)
+// followed by the real distance and length in lz77_far_base
+// bit groups (in either coding, they are rare and long).
+// It can reach anywhere back in the input regardless of `window_bits`.
+
+static inline void lz77_write_far(lz77_t* lz, uint64_t* b64,
+        uint32_t* bp, size_t pos, size_t len, lz77_code_t c) {
+    lz77_write_bits(lz, b64, bp, 0b11, 2); // flags
+    if (c.coding == lz77_coding_bucket) {
+        lz77_write_bucket(lz, b64, bp, 0, c.pos_k);
+    } else {
+        lz77_write_number(lz, b64, bp, 0, c.base);
+    }
+    lz77_write_number(lz, b64, bp, pos, lz77_far_base);
+    lz77_write_number(lz, b64, bp, len, lz77_far_base);
+}
+
+// Number of bits lz77_write_number(), lz77_write_bucket() and
+// lz77_write_match() will emit:
+
+static inline uint32_t lz77_number_bits(uint64_t v, uint8_t base) {
+    uint32_t bits = base + 1;
+    while ((v >>= base) != 0) { bits += base + 1; }
     return bits;
 }
 
-static void lz77_read_header(lz77_t* lz, size_t *bytes, uint8_t *window_bits) {
-    lz77_if_error_return(lz);
-    *bytes = (size_t)lz->read(lz);
-    *window_bits = (uint8_t)lz->read(lz);
-    if (*window_bits < 10 || *window_bits > 20) { lz77_return_invalid(lz); }
+static inline uint32_t lz77_bucket_bits(uint64_t v, uint8_t k) {
+    return 2 * lz77_log2(v + ((uint64_t)1 << k)) - k + 1;
 }
 
-static void lz77_decompress(lz77_t* lz, uint8_t* data, size_t bytes,
+static inline uint32_t lz77_match_bits(const size_t* rep, size_t pos,
+        size_t len, lz77_code_t c) {
+    const uint64_t code = lz77_match_code(rep, pos);
+    return c.coding == lz77_coding_bucket ?
+        2 + lz77_bucket_bits(code, c.pos_k) + lz77_bucket_bits(len, c.len_k) :
+        2 + lz77_number_bits(code, c.base) + lz77_number_bits(len, c.base);
+}
+
+// bits saved by the match relative to ~8 bits per literal
+
+static inline int64_t lz77_match_gain(const size_t* rep, size_t pos,
+        size_t len, lz77_code_t c) {
+    return (int64_t)len * 8 - (int64_t)lz77_match_bits(rep, pos, len, c);
+}
+
+// The second header word is window_bits, the coding above it and the
+// lz77_header_reps bit. Streams without that bit were written before
+// repeat offsets: their distances are coded as is (lz77_t.legacy).
+
+static const uint64_t lz77_header_reps = (uint64_t)1 << 16;
+
+static inline uint64_t lz77_header_format(const lz77_t* lz,
         uint8_t window_bits) {
+    return (uint64_t)window_bits | ((uint64_t)lz->coding << 8) |
+           lz77_header_reps;
+}
+
+static void lz77_write_header(lz77_t* lz, size_t bytes, uint8_t window_bits) {
     lz77_if_error_return(lz);
-    uint64_t b64 = 0;
-    uint32_t bp = 0;
-    if (window_bits < 10 || window_bits > 20) { lz77_return_invalid(lz); }
-    const size_t window = ((size_t)1U) << window_bits;
-    const uint8_t base = (window_bits - 4) / 2;
-    size_t i = 0; // output data[i]
-    while (i < bytes) {
-        uint64_t bit0 = lz77_read_bit(lz, &b64, &bp);
-        lz77_if_error_return(lz);
-        if (bit0) {
-            uint64_t bit1 = lz77_read_bit(lz, &b64, &bp);
-            lz77_if_error_return(lz);
-            if (bit1) {
-                uint64_t pos = lz77_read_number(lz, &b64, &bp, base);
-                lz77_if_error_return(lz);
-                uint64_t len = lz77_read_number(lz, &b64, &bp, base);
-                lz77_if_error_return(lz);
-                rt_assert(0 < pos && pos < window);
-                if (!(0 < pos && pos < window)) { lz77_return_invalid(lz); }
-                rt_assert(0 < len);
-                if (len == 0) { lz77_return_invalid(lz); }
-                // Cannot do memcpy() here because of possible overlap.
-                // memcpy() may read more than one byte at a time.
-                uint8_t* s = data - (size_t)pos;
-                const size_t n = i + (size_t)len;
-                while (i < n) { data[i] = s[i]; i++; }
-            } else { // byte >= 0x80
-                uint64_t b = lz77_read_bits(lz, &b64, &bp, 7);
-                lz77_if_error_return(lz);
-                data[i] = (uint8_t)b | 0x80;
-                i++;
+    if (window_bits < lz77_window_bits_min ||
+        window_bits > lz77_window_bits_max) {
+        lz77_return_invalid(lz);
+    }
+    if (lz->coding > lz77_coding_bucket) { lz77_return_invalid(lz); }
+    const uint64_t header[2] = {
+        (uint64_t)bytes, lz77_header_format(lz, window_bits)
+    };
+    lz77_write_span(lz, (const uint8_t*)header, sizeof(header));
+}
+
+// Match finder: hash chains (zlib style) keyed on the next
+// min_match bytes. head[] maps a hash to the most recent position + 1
+// and chain[] links each position to the previous one with the same hash.
+// Positions are stored as uint32_t + 1 (0 means empty); only the distance
+// `i - j` is ever used, so wrap around on inputs above 4GB is harmless:
+// every candidate is verified byte by byte before it is accepted.
+//
+// Binary trees (LZMA BT style) share head[] but instead of a chain each
+// hash bucket is a binary search tree of the window positions ordered by
+// the bytes that follow them. Inserting a position re-roots the tree at
+// it and the walk from the root visits the longest matches in
+// O(log(window)) nodes instead of the whole chain.
+
+enum {
+    lz77_auto_block    = 1 << 16, // bytes per lz77_min_match_auto choice
+    lz77_hash_bits     = 10,      // minimum head[] 1 << lz77_hash_bits
+    lz77_hash_ahead    = 8,       // hashes computed and prefetched ahead
+    lz77_hash_cached   = 16,      // smaller head[] is not prefetched
+    lz77_sa_block      = 1 << 24, // maximum bytes per suffix array block
+    lz77_max_matches   = 256,     // matches[] recorded for optimal parse
+    lz77_opt_block     = 4096     // positions per optimal parse block
+};
+
+typedef struct lz77_match_s {
+    size_t len;
+    size_t pos; // distance
+} lz77_match_t;
+
+typedef struct lz77_finder_s {
+    const uint8_t* data;
+    size_t    bytes;
+    size_t    window;
+    uint8_t   type;  // lz77_finder_*
+    uint32_t  depth; // maximum number of chain or tree candidates to check
+    size_t    nice;  // stop search when match is at least that long
+    uint8_t   skip;  // log2 of failed searches before stepping faster
+    uint8_t   min_match; // shortest match returned (for current block)
+    uint8_t   hash_len;  // bytes hashed [3..5] <= min_match
+    size_t    auto_next; // next lz77_min_match_auto block or SIZE_MAX
+    uint32_t* head;  // [1 << hash_bits]
+    uint8_t   hash_bits;
+    uint32_t  hash[lz77_hash_ahead]; // hashes of the positions before `ahead`
+    size_t    ahead; // next position to hash and prefetch
+    uint32_t* chain; // [mask + 1] ring buffer indexed by position
+    uint32_t* tree;  // [(mask + 1) * 2] left and right children
+    size_t    mask;
+    size_t    next;  // next position to insert
+    size_t    end;   // matches do not extend beyond data[end]
+    size_t    rep[lz77_reps]; // repeat offsets at `next`
+    lz77_match_t* matches; // null or [lz77_max_matches] for optimal parse
+    uint32_t  count; // number of matches[] found by lz77_find()
+    int32_t*  sa;    // suffix array, rank[] and lcp[] of data[from..indexed)
+    size_t    block; // bytes indexed after the window
+    size_t    beyond; // bytes indexed past each block
+    size_t    from;
+    size_t    to;    // positions [from + window - 1..to) are searched
+    size_t    indexed; // lcp[] is cut at data[indexed]
+} lz77_finder_t;
+
+typedef struct lz77_level_s {
+    uint8_t  finder;
+    uint8_t  parse;
+    uint32_t chain;
+    uint32_t nice;
+    uint8_t  hash_bits; // maximum head[] size is 1 << hash_bits
+    uint8_t  skip;      // see lz77_compress_lazy(), 0 never skips
+    uint8_t  min_match;
+} lz77_level_t;
+
+static const lz77_level_t lz77_levels[lz77_level_best + 1] = {
+    { 0 },
+    { lz77_finder_chain,  lz77_parse_greedy,     4,   16, 14, 5, lz77_min_match_auto }, // 1
+    { lz77_finder_chain,  lz77_parse_greedy,     8,   32, 15, 6, lz77_min_match_auto }, // 2
+    { lz77_finder_chain,  lz77_parse_lazy,      16,   64, 16, 7, 3                   }, // 3
+    { lz77_finder_chain,  lz77_parse_lazy,      64,  128, 17, 8, 3                   }, // 4
+    { lz77_finder_chain,  lz77_parse_lazy,     128,  256, 17, 8, 3                   }, // 5
+    { lz77_finder_tree,   lz77_parse_lazy2,     16,   64, 18, 0, 3                   }, // 6
+    { lz77_finder_tree,   lz77_parse_lazy2,     64,  256, 19, 0, 3                   }, // 7
+    { lz77_finder_tree,   lz77_parse_optimal,   64,  256, 20, 0, 3                   }, // 8
+    { lz77_finder_tree,   lz77_parse_optimal,  256, 1024, 22, 0, 3                   }, // 9
+};
+
+static const lz77_level_t* lz77_level(const lz77_t* lz) {
+    return &lz77_levels[lz->level != 0 ? lz->level : lz77_level_default];
+}
+
+// Multiplicative (Fibonacci) hash of the first `len` [3..5] bytes at `p`
+// with a single unaligned load: the bytes that are not hashed are shifted
+// out and the product's top `bits` are the most mixed ones. Reads
+// lz77_hash_read(len) bytes at `p`.
+
+static inline uint8_t lz77_hash_read(uint8_t len) {
+    return len <= 4 ? 4 : 8;
+}
+
+static inline uint32_t lz77_hash(const uint8_t* p, uint8_t len,
+        uint8_t bits) {
+    if (len <= 4) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        #ifdef lz77_little_endian
+        v <<= (4 - len) * 8;
+        #else
+        v >>= (4 - len) * 8;
+        #endif
+        return (v * 2654435761U) >> (32 - bits);
+    } else {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        #ifdef lz77_little_endian
+        v <<= (8 - len) * 8;
+        #else
+        v >>= (8 - len) * 8;
+        #endif
+        return (uint32_t)((v * 0x9E3779B97F4A7C15ULL) >> (64 - bits));
+    }
+}
+
+// head[] is megabytes at high levels and every position hits a random
+// bucket in it. Hashes are computed lz77_hash_ahead positions before
+// they are needed and their buckets prefetched, so the cache miss is
+// served while the positions in between are searched or inserted.
+// Positions are visited in order; after a jump forward (skip
+// acceleration) the pipeline restarts at the new position and refills
+// two hashes per call so that jumping does not waste hashing.
+// Small head[] of the fast levels stays in cache and is hashed directly.
+// Requires i + lz77_hash_read(f->hash_len) <= f->bytes.
+
+static inline uint32_t lz77_head_index(lz77_finder_t* f, size_t i) {
+    if (f->hash_bits <= lz77_hash_cached) {
+        return lz77_hash(f->data + i, f->hash_len, f->hash_bits);
+    }
+    if (i >= f->ahead || i + lz77_hash_ahead < f->ahead) { f->ahead = i; }
+    const size_t last = f->bytes - lz77_hash_read(f->hash_len);
+    const size_t end = f->ahead + 2 < i + lz77_hash_ahead ?
+                       f->ahead + 2 : i + lz77_hash_ahead;
+    while (f->ahead < end && f->ahead <= last) {
+        const uint32_t h = lz77_hash(f->data + f->ahead, f->hash_len,
+                                     f->hash_bits);
+        f->hash[f->ahead % lz77_hash_ahead] = h;
+        lz77_prefetch(&f->head[h]);
+        f->ahead++;
+    }
+    // half way there the bucket is in cache and its first candidate
+    // (most likely still the same one) is prefetched as well:
+    const size_t k = i + lz77_hash_ahead / 2;
+    if (k < f->ahead) {
+        const uint32_t c = f->head[f->hash[k % lz77_hash_ahead]];
+        const size_t distance = (uint32_t)(k + 1 - c);
+        if (c != 0 && distance <= k) {
+            const size_t j = k - distance;
+            const size_t m = j & f->mask;
+            lz77_prefetch(f->data + j);
+            lz77_prefetch(f->chain != null ? &f->chain[m] : &f->tree[m * 2]);
+        }
+    }
+    return f->hash[i % lz77_hash_ahead];
+}
+
+static void lz77_finder_init(lz77_t* lz, lz77_finder_t* f,
+        const uint8_t* data, size_t bytes, size_t window) {
+    memset(f, 0x00, sizeof(*f));
+    f->data   = data;
+    f->bytes  = bytes;
+    f->end    = bytes;
+    memcpy(f->rep, lz77_rep_start, sizeof(f->rep));
+    f->window = window;
+    const lz77_level_t* level = lz77_level(lz);
+    f->type   = lz->finder != 0 ? lz->finder : level->finder;
+    f->depth  = lz->chain  != 0 ? lz->chain  : level->chain;
+    f->nice   = lz->nice   != 0 ? lz->nice   : level->nice;
+    f->skip   = level->skip;
+    const uint8_t min_match = lz->min_match != 0 ?
+                              lz->min_match : level->min_match;
+    if (min_match == lz77_min_match_auto) {
+        f->min_match = lz77_min_match_min;
+        f->auto_next = 0;
+    } else {
+        f->min_match = min_match;
+        f->auto_next = SIZE_MAX;
+    }
+    f->hash_len = f->auto_next == 0 ? 3 :
+                  f->min_match < 5 ? f->min_match : 5;
+    if (f->type == lz77_finder_chain || f->type == lz77_finder_tree) {
+        // chain[] and tree[] do not need to be longer than the input:
+        size_t n = window;
+        while (n > 1 && n / 2 >= bytes) { n /= 2; }
+        f->mask = n - 1;
+        // about 4 positions per hash bucket up to the level's maximum;
+        // fast levels keep head[] small enough to stay in cache:
+        f->hash_bits = lz77_hash_bits;
+        while (f->hash_bits < level->hash_bits &&
+               ((size_t)1 << (f->hash_bits + 2)) < n) {
+            f->hash_bits++;
+        }
+        f->head = (uint32_t*)calloc((size_t)1 << f->hash_bits,
+                                    sizeof(uint32_t));
+        if (f->type == lz77_finder_chain) {
+            f->chain = (uint32_t*)malloc(n * sizeof(uint32_t));
+        } else {
+            f->tree = (uint32_t*)malloc(n * 2 * sizeof(uint32_t));
+        }
+        if (f->head == null || (f->chain == null && f->tree == null)) {
+            lz->error = ENOMEM;
+        }
+    } else if (f->type == lz77_finder_sa) {
+        // suffix array memory is 12 bytes per indexed byte; long windows
+        // are only searched lz77_sa_block bytes back:
+        if (window > lz77_sa_block) { window = lz77_sa_block; }
+        f->window = window;
+        // sa[m + 1], rank[m] and lcp[m] also serve as SA-IS workspace
+        // most of the suffixes in the block must be within the window
+        // from each other or the walk over neighbours gets too long:
+        f->block = window * 2 < lz77_sa_block ? window * 2 : lz77_sa_block;
+        f->beyond = f->nice < f->block ? f->nice : f->block;
+        if (f->beyond < lz77_min_match_max) { f->beyond = lz77_min_match_max; }
+        const size_t m = bytes < window - 1 + f->block + f->beyond ?
+                         bytes : window - 1 + f->block + f->beyond;
+        if (m > INT32_MAX / 4) {
+            lz->error = EINVAL;
+        } else {
+            f->sa = (int32_t*)malloc((m * 3 + 1024) * sizeof(int32_t));
+            if (f->sa == null) { lz->error = ENOMEM; }
+        }
+    } else if (f->type != lz77_finder_scan) {
+        lz->error = EINVAL;
+    }
+}
+
+static void lz77_finder_fini(lz77_finder_t* f) {
+    free(f->head);
+    free(f->chain);
+    free(f->tree);
+    free(f->sa);
+    f->head  = null;
+    f->chain = null;
+    f->tree  = null;
+    f->sa    = null;
+}
+
+// Records improving matches for optimal parse: lengths strictly
+// increase and each one has the shortest distance seen for it.
+
+static inline void lz77_found(lz77_finder_t* f, size_t len, size_t pos) {
+    if (f->matches != null && len >= f->min_match) {
+        lz77_match_t* m = f->matches;
+        if (f->count > 0 && m[f->count - 1].len == len) {
+            m[f->count - 1].pos = pos;
+        } else {
+            if (f->count == lz77_max_matches) { f->count--; }
+            m[f->count].len = len;
+            m[f->count].pos = pos;
+            f->count++;
+        }
+    }
+}
+
+static inline size_t lz77_match_len(const uint8_t* a, const uint8_t* b,
+        size_t n) {
+    // compares 32, 16 or 8 bytes at a time; the first mismatching
+    // byte is the lowest set bit of the difference (little endian):
+    size_t k = 0;
+    #ifdef lz77_avx2
+    while (k + 32 <= n) {
+        const __m256i x = _mm256_loadu_si256((const __m256i*)(a + k));
+        const __m256i y = _mm256_loadu_si256((const __m256i*)(b + k));
+        const uint32_t e = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+        if (e != 0xFFFFFFFFu) { return k + lz77_ctz32(~e); }
+        k += 32;
+    }
+    #endif
+    #ifdef lz77_sse2
+    while (k + 16 <= n) {
+        const __m128i x = _mm_loadu_si128((const __m128i*)(a + k));
+        const __m128i y = _mm_loadu_si128((const __m128i*)(b + k));
+        const uint32_t e = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+        if (e != 0xFFFFu) { return k + lz77_ctz32(~e); }
+        k += 16;
+    }
+    #endif
+    #ifdef lz77_little_endian
+    while (k + 8 <= n) {
+        uint64_t x;
+        uint64_t y;
+        memcpy(&x, a + k, sizeof(x));
+        memcpy(&y, b + k, sizeof(y));
+        if (x != y) { return k + lz77_ctz64(x ^ y) / 8; }
+        k += 8;
+    }
+    #endif
+    while (k < n && a[k] == b[k]) { k++; }
+    return k;
+}
+
+// lz77_min_match_auto: short matches pay off in text while binary data
+// has plenty of coincidental short repeats that cost more bits than the
+// literals they replace, hide longer matches from a greedy parse and
+// slow the finder down. A quick greedy parse of a sample from the start
+// of the block is priced for each minimum and the cheapest one wins
+// (the longer one on a tie because it is faster).
+
+static uint8_t lz77_auto_min_match(const uint8_t* data, size_t bytes,
+        lz77_code_t c) {
+    enum { sample = 4096, bits = 12 };
+    const size_t n = bytes < sample ? bytes : sample;
+    static const size_t rep[lz77_reps] = { 0 };
+    uint16_t head[1 << bits];
+    uint8_t best = lz77_min_match_min;
+    uint64_t best_price = UINT64_MAX;
+    for (uint8_t m = lz77_min_match_min; m <= 6; m++) {
+        const uint8_t h_len = m < 5 ? m : 5;
+        memset(head, 0xFF, sizeof(head));
+        uint64_t price = 0;
+        size_t i = 0;
+        while (i < n) {
+            size_t len = 0;
+            if (i + lz77_hash_read(h_len) <= n) {
+                const uint32_t h = lz77_hash(data + i, h_len, bits);
+                const size_t j = head[h];
+                head[h] = (uint16_t)i;
+                if (j < i) { len = lz77_match_len(data + j, data + i, n - i); }
+                if (len >= m && lz77_match_gain(rep, i - j, len, c) > 0) {
+                    price += lz77_match_bits(rep, i - j, len, c);
+                    i += len;
+                    continue;
+                }
             }
-        } else { // literal byte
-            uint64_t b = lz77_read_bits(lz, &b64, &bp, 7); // ASCII byte < 0x80
-            lz77_if_error_return(lz);
-            data[i] = (uint8_t)b;
+            price += data[i] < 0x80 ? 8 : 9;
             i++;
         }
+        if (price <= best_price) {
+            best_price = price;
+            best = m;
+        }
+    }
+    return best;
+}
+
+static inline void lz77_min_match_update(lz77_finder_t* f, size_t i,
+        lz77_code_t c) {
+    if (i >= f->auto_next) {
+        const size_t n = f->bytes - i < lz77_auto_block ?
+                         f->bytes - i : lz77_auto_block;
+        f->min_match = lz77_auto_min_match(f->data + i, n, c);
+        f->auto_next = i + lz77_auto_block;
+    }
+}
+
+// Inserts position `i` as the new root of its hash bucket tree. Nodes
+// visited on the way down are split into the left (lexicographically
+// smaller) and right (greater) subtrees of the new root. `len` and `pos`
+// are updated with the longest match seen on the way (which is the
+// longest match in the tree unless `depth` cuts the descent short).
+
+static void lz77_tree_insert(lz77_finder_t* f, size_t i,
+        size_t* len, size_t* pos) {
+    const uint8_t* d = f->data;
+    const size_t n = f->bytes - i;
+    const size_t limit = n < f->nice ? n : f->nice;
+    const uint32_t h = lz77_head_index(f, i);
+    const uint32_t i1 = (uint32_t)(i + 1);
+    uint32_t c = f->head[h];
+    f->head[h] = i1;
+    uint32_t* left  = &f->tree[(i & f->mask) * 2];
+    uint32_t* right = &f->tree[(i & f->mask) * 2 + 1];
+    size_t left_len  = 0; // common prefix with everything in left subtree
+    size_t right_len = 0; // ... and right subtree
+    uint32_t depth = f->depth;
+    for (;;) {
+        const size_t distance = (uint32_t)(i1 - c);
+        if (c == 0 || depth == 0 || distance >= f->window || distance > i) {
+            *left  = 0;
+            *right = 0;
+            break;
+        }
+        depth--;
+        const size_t j = i - distance;
+        uint32_t* pair = &f->tree[(j & f->mask) * 2];
+        size_t k = left_len < right_len ? left_len : right_len;
+        k += lz77_match_len(d + j + k, d + i + k, limit - k);
+        if (k > *len) {
+            *len = k;
+            *pos = distance;
+            lz77_found(f, k, distance);
+        }
+        if (k == limit) { // `j` is replaced by `i` in the tree
+            *left  = pair[0];
+            *right = pair[1];
+            break;
+        }
+        if (d[j + k] < d[i + k]) {
+            *left = c;
+            left = &pair[1];
+            c = *left;
+            left_len = k;
+        } else {
+            *right = c;
+            right = &pair[0];
+            c = *right;
+            right_len = k;
+        }
+    }
+}
+
+static inline void lz77_insert(lz77_finder_t* f, size_t i) {
+    if (i + lz77_hash_read(f->hash_len) <= f->bytes) {
+        if (f->type == lz77_finder_chain) {
+            const uint32_t h = lz77_head_index(f, i);
+            f->chain[i & f->mask] = f->head[h];
+            f->head[h] = (uint32_t)(i + 1);
+        } else if (f->type == lz77_finder_tree) {
+            size_t len = 0;
+            size_t pos = 0;
+            lz77_tree_insert(f, i, &len, &pos);
+        }
+    }
+}
+
+static void lz77_find_chain(lz77_finder_t* f, size_t i,
+        size_t* len, size_t* pos) {
+    const uint8_t* d = f->data;
+    const size_t n = f->bytes - i;
+    if (n < lz77_hash_read(f->hash_len)) { return; }
+    const uint32_t i1 = (uint32_t)(i + 1);
+    uint32_t c = f->head[lz77_head_index(f, i)];
+    uint32_t depth = f->depth;
+    size_t last = 0; // distance of previous candidate
+    while (c != 0 && depth > 0) {
+        const size_t distance = (uint32_t)(i1 - c);
+        // distances must strictly grow along the chain, otherwise
+        // the entry is stale (overwritten ring slot or 4GB wrap):
+        if (distance <= last || distance >= f->window || distance > i) {
+            break;
+        }
+        const size_t j = i - distance;
+        // cheap rejection: a longer match must agree at d[*len]
+        if (*len == 0 || d[j + *len] == d[i + *len]) {
+            const size_t k = lz77_match_len(d + j, d + i, n);
+            if (k > *len) {
+                *len = k;
+                *pos = distance;
+                lz77_found(f, k, distance);
+                if (k == n || k >= f->nice) { break; }
+            }
+        }
+        c = f->chain[j & f->mask];
+        last = distance;
+        depth--;
+    }
+}
+
+static void lz77_find_scan(lz77_finder_t* f, size_t i,
+        size_t* len, size_t* pos) {
+    const uint8_t* d = f->data;
+    const size_t n = f->bytes - i;
+    const size_t min_j = i >= f->window ? i - f->window + 1 : 0;
+    size_t j = i;
+    #if defined(lz77_avx2) || defined(lz77_sse2)
+    // candidates are tested 32 or 16 at a time: first 4 bytes (or 3 while
+    // no 3 byte match was found) must be equal to be extended. Loads stay
+    // below d[i + 2] so `n` >= 4 is enough for d[i + 3].
+    if (n >= 4) {
+        #ifdef lz77_avx2
+        const __m256i c0 = _mm256_set1_epi8((char)d[i + 0]);
+        const __m256i c1 = _mm256_set1_epi8((char)d[i + 1]);
+        const __m256i c2 = _mm256_set1_epi8((char)d[i + 2]);
+        const __m256i c3 = _mm256_set1_epi8((char)d[i + 3]);
+        while (j >= min_j + 32) {
+            j -= 32;
+            const uint8_t* p = d + j;
+            __m256i e = _mm256_and_si256(
+                _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), c0),
+                _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + 1)), c1));
+            e = _mm256_and_si256(e,
+                _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + 2)), c2));
+            if (*len >= 3) {
+                e = _mm256_and_si256(e,
+                    _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + 3)), c3));
+            }
+            uint32_t mask = (uint32_t)_mm256_movemask_epi8(e);
+            while (mask != 0) { // nearest (highest) candidate first
+                const uint32_t t = 31 - lz77_clz32(mask);
+                mask &= ~(1U << t);
+                const size_t k = lz77_match_len(p + t, d + i, n);
+                if (k > *len) {
+                    *len = k;
+                    *pos = i - j - t;
+                    lz77_found(f, k, *pos);
+                    if (k == n || k >= f->nice) { return; }
+                }
+            }
+        }
+        #endif
+        #ifdef lz77_sse2
+        const __m128i b0 = _mm_set1_epi8((char)d[i + 0]);
+        const __m128i b1 = _mm_set1_epi8((char)d[i + 1]);
+        const __m128i b2 = _mm_set1_epi8((char)d[i + 2]);
+        const __m128i b3 = _mm_set1_epi8((char)d[i + 3]);
+        while (j >= min_j + 16) {
+            j -= 16;
+            const uint8_t* p = d + j;
+            __m128i e = _mm_and_si128(
+                _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), b0),
+                _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + 1)), b1));
+            e = _mm_and_si128(e,
+                _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + 2)), b2));
+            if (*len >= 3) {
+                e = _mm_and_si128(e,
+                    _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + 3)), b3));
+            }
+            uint32_t mask = (uint32_t)_mm_movemask_epi8(e);
+            while (mask != 0) {
+                const uint32_t t = 31 - lz77_clz32(mask);
+                mask &= ~(1U << t);
+                const size_t k = lz77_match_len(p + t, d + i, n);
+                if (k > *len) {
+                    *len = k;
+                    *pos = i - j - t;
+                    lz77_found(f, k, *pos);
+                    if (k == n || k >= f->nice) { return; }
+                }
+            }
+        }
+        #endif
+    }
+    #endif
+    while (j > min_j) {
+        j--;
+        lz77_assert(0 < i - j && i - j < f->window);
+        const size_t k = lz77_match_len(d + j, d + i, n);
+        if (k > *len) {
+            *len = k;
+            *pos = i - j;
+            lz77_found(f, k, i - j);
+            if (k == n || k >= f->nice) { break; }
+        }
+    }
+}
+
+// Suffix array finder: SA-IS (Nong, Zhang, Chan 2009) builds the suffix
+// array of a whole block of input at once in linear time, Kasai et al.
+// adds the longest common prefixes of neighbouring suffixes. The longest
+// previous match for position `i` is then the nearest suffix above or
+// below rank[i] that starts earlier within the window; LCP of the two
+// is the minimum of lcp[] between their ranks.
+// Blocks of two windows (up to lz77_sa_block bytes) are indexed together
+// with the preceding window, costing 12 bytes of memory per indexed byte.
+// Each block is indexed `nice` bytes further than it is searched so that
+// lcp[] is rarely cut by its end; candidates whose common prefix reaches
+// the end of the indexed bytes are extended by comparing the input.
+
+static inline int32_t lz77_sais_chr(const void* s, int32_t cs, int32_t n,
+        int32_t i) {
+    // level 0 is the input bytes + 1 followed by virtual sentinel 0
+    return cs == 1 ? (i == n - 1 ? 0 : (int32_t)((const uint8_t*)s)[i] + 1) :
+                     ((const int32_t*)s)[i];
+}
+
+static inline bool lz77_sais_s_type(const uint32_t* t, int32_t i) {
+    return (t[i >> 5] >> (i & 31)) & 1;
+}
+
+static inline void lz77_sais_set_type(uint32_t* t, int32_t i, bool s_type) {
+    if (s_type) {
+        t[i >> 5] |= 1U << (i & 31);
+    } else {
+        t[i >> 5] &= ~(1U << (i & 31));
+    }
+}
+
+static inline bool lz77_sais_lms(const uint32_t* t, int32_t i) {
+    return i > 0 && lz77_sais_s_type(t, i) && !lz77_sais_s_type(t, i - 1);
+}
+
+static void lz77_sais_buckets(const void* s, int32_t* bkt, int32_t n,
+        int32_t k, int32_t cs, bool end) {
+    memset(bkt, 0x00, sizeof(int32_t) * (size_t)(k + 1));
+    for (int32_t i = 0; i < n; i++) { bkt[lz77_sais_chr(s, cs, n, i)]++; }
+    int32_t sum = 0;
+    for (int32_t i = 0; i <= k; i++) {
+        sum += bkt[i];
+        bkt[i] = end ? sum : sum - bkt[i];
+    }
+}
+
+static void lz77_sais_induce(const uint32_t* t, int32_t* sa, const void* s,
+        int32_t* bkt, int32_t n, int32_t k, int32_t cs) {
+    lz77_sais_buckets(s, bkt, n, k, cs, false); // L-type from the left
+    for (int32_t i = 0; i < n; i++) {
+        const int32_t j = sa[i] - 1;
+        if (j >= 0 && !lz77_sais_s_type(t, j)) {
+            sa[bkt[lz77_sais_chr(s, cs, n, j)]++] = j;
+        }
+    }
+    lz77_sais_buckets(s, bkt, n, k, cs, true); // S-type from the right
+    for (int32_t i = n - 1; i >= 0; i--) {
+        const int32_t j = sa[i] - 1;
+        if (j >= 0 && lz77_sais_s_type(t, j)) {
+            sa[--bkt[lz77_sais_chr(s, cs, n, j)]] = j;
+        }
+    }
+}
+
+// `s` of `n` symbols in [0..k] must end with unique smallest symbol 0.
+// `work` must have room for 1.07 * n + 300 int32_t (types and buckets
+// of this and all recursive levels).
+
+static void lz77_sais(const void* s, int32_t* sa, int32_t n, int32_t k,
+        int32_t cs, int32_t* work) {
+    uint32_t* t = (uint32_t*)work;
+    int32_t* bkt = work + (n + 31) / 32;
+    int32_t* rest = bkt + k + 1;
+    lz77_sais_set_type(t, n - 1, true);
+    if (n > 1) { lz77_sais_set_type(t, n - 2, false); }
+    for (int32_t i = n - 3; i >= 0; i--) {
+        const int32_t c0 = lz77_sais_chr(s, cs, n, i);
+        const int32_t c1 = lz77_sais_chr(s, cs, n, i + 1);
+        lz77_sais_set_type(t, i, c0 < c1 ||
+                           (c0 == c1 && lz77_sais_s_type(t, i + 1)));
+    }
+    // stage 1: sort LMS substrings
+    lz77_sais_buckets(s, bkt, n, k, cs, true);
+    for (int32_t i = 0; i < n; i++) { sa[i] = -1; }
+    for (int32_t i = 1; i < n; i++) {
+        if (lz77_sais_lms(t, i)) { sa[--bkt[lz77_sais_chr(s, cs, n, i)]] = i; }
+    }
+    lz77_sais_induce(t, sa, s, bkt, n, k, cs);
+    // compact sorted LMS substrings into the first n1 items of sa[]
+    int32_t n1 = 0;
+    for (int32_t i = 0; i < n; i++) {
+        if (lz77_sais_lms(t, sa[i])) { sa[n1++] = sa[i]; }
+    }
+    // name LMS substrings
+    for (int32_t i = n1; i < n; i++) { sa[i] = -1; }
+    int32_t name = 0;
+    int32_t prev = -1;
+    for (int32_t i = 0; i < n1; i++) {
+        const int32_t p = sa[i];
+        bool diff = false;
+        for (int32_t d = 0; d < n; d++) {
+            if (prev == -1 ||
+                lz77_sais_chr(s, cs, n, p + d) !=
+                lz77_sais_chr(s, cs, n, prev + d) ||
+                lz77_sais_s_type(t, p + d) != lz77_sais_s_type(t, prev + d)) {
+                diff = true;
+                break;
+            } else if (d > 0 && (lz77_sais_lms(t, p + d) ||
+                                 lz77_sais_lms(t, prev + d))) {
+                break;
+            }
+        }
+        if (diff) { name++; prev = p; }
+        sa[n1 + p / 2] = name - 1;
+    }
+    for (int32_t i = n - 1, j = n - 1; i >= n1; i--) {
+        if (sa[i] >= 0) { sa[j--] = sa[i]; }
+    }
+    // stage 2: sort reduced problem recursively if names are not unique
+    int32_t* sa1 = sa;
+    int32_t* s1 = sa + n - n1;
+    if (name < n1) {
+        lz77_sais(s1, sa1, n1, name - 1, (int32_t)sizeof(int32_t), rest);
+    } else {
+        for (int32_t i = 0; i < n1; i++) { sa1[s1[i]] = i; }
+    }
+    // stage 3: induce the result from sorted LMS suffixes
+    lz77_sais_buckets(s, bkt, n, k, cs, true);
+    for (int32_t i = 1, j = 0; i < n; i++) {
+        if (lz77_sais_lms(t, i)) { s1[j++] = i; }
+    }
+    for (int32_t i = 0; i < n1; i++) { sa1[i] = s1[sa1[i]]; }
+    for (int32_t i = n1; i < n; i++) { sa[i] = -1; }
+    for (int32_t i = n1 - 1; i >= 0; i--) {
+        const int32_t j = sa[i];
+        sa[i] = -1;
+        sa[--bkt[lz77_sais_chr(s, cs, n, j)]] = j;
+    }
+    lz77_sais_induce(t, sa, s, bkt, n, k, cs);
+}
+
+static void lz77_sa_index(lz77_finder_t* f, size_t i) {
+    // index block [i..i + f->block) together with the window before it
+    const size_t from = i >= f->window ? i - f->window + 1 : 0;
+    const size_t to = f->bytes - i > f->block ? i + f->block : f->bytes;
+    const size_t indexed = f->bytes - to > f->beyond ?
+                           to + f->beyond : f->bytes;
+    const int32_t m = (int32_t)(indexed - from);
+    int32_t* sa   = f->sa;
+    int32_t* rank = f->sa + m + 1;
+    int32_t* lcp  = rank + m;
+    lz77_sais(f->data + from, sa, m + 1, 256, 1, rank);
+    sa++; // skip virtual sentinel suffix at sa[0]
+    for (int32_t r = 0; r < m; r++) { rank[sa[r]] = r; }
+    // Kasai, Lee, Arimura, Arikawa, Park 2001:
+    const uint8_t* d = f->data + from;
+    int32_t h = 0;
+    lcp[0] = 0;
+    for (int32_t p = 0; p < m; p++) {
+        if (rank[p] > 0) {
+            const int32_t q = sa[rank[p] - 1];
+            const int32_t n = m - (p > q ? p : q);
+            h += (int32_t)lz77_match_len(d + p + h, d + q + h, (size_t)(n - h));
+            lcp[rank[p]] = h;
+            if (h > 0) { h--; }
+        } else {
+            h = 0;
+        }
+    }
+    f->from = from;
+    f->to = to;
+    f->indexed = indexed;
+}
+
+static void lz77_find_sa(lz77_finder_t* f, size_t i,
+        size_t* len, size_t* pos) {
+    if (i >= f->to) { lz77_sa_index(f, i); }
+    const int32_t m = (int32_t)(f->indexed - f->from);
+    const int32_t* sa   = f->sa + 1;
+    const int32_t* rank = f->sa + m + 1;
+    const int32_t* lcp  = rank + m;
+    const int32_t p = (int32_t)(i - f->from);
+    const int32_t r = rank[p];
+    const uint8_t* d = f->data;
+    // common prefixes of `cut` bytes may continue past data[indexed]
+    // (i < to thus cut > beyond >= min_match):
+    const size_t cut = f->indexed - i;
+    // for optimal parse shorter but closer matches are collected too:
+    lz77_match_t candidate[lz77_max_matches];
+    uint32_t candidates = 0;
+    // earlier suffixes within window above and below rank `r`:
+    for (int32_t dir = -1; dir <= 1 && *len < f->nice; dir += 2) {
+        int32_t x = r;
+        size_t k = SIZE_MAX; // common prefix of suffixes `r` and `x`
+        size_t closest = SIZE_MAX;
+        uint32_t depth = f->depth;
+        while (depth > 0) {
+            const int32_t l = dir < 0 ? lcp[x] : (x + 1 < m ? lcp[x + 1] : 0);
+            x += dir;
+            if ((size_t)l < k) { k = (size_t)l; }
+            if (k < f->min_match) { break; }
+            if (k < *len && k < cut && f->matches == null) { break; }
+            if (sa[x] < p && (size_t)(p - sa[x]) < f->window) {
+                // keep walking: same length may be found closer
+                const size_t distance = (size_t)(p - sa[x]);
+                size_t n = k;
+                if (k == cut) {
+                    n += lz77_match_len(d + f->indexed - distance,
+                                        d + f->indexed,
+                                        f->bytes - f->indexed);
+                }
+                if (n > *len || (n == *len && distance < *pos)) {
+                    *len = n;
+                    *pos = distance;
+                }
+                if (f->matches != null && (distance < closest || k == cut) &&
+                    candidates < lz77_max_matches) {
+                    if (distance < closest) { closest = distance; }
+                    candidate[candidates].len = n;
+                    candidate[candidates].pos = distance;
+                    candidates++;
+                }
+                if (n >= f->nice) { break; }
+            }
+            depth--;
+        }
+    }
+    if (candidates > 0) {
+        // sort by length descending and keep the ones that are closer
+        // than any longer match:
+        for (uint32_t u = 1; u < candidates; u++) {
+            const lz77_match_t c = candidate[u];
+            uint32_t v = u;
+            while (v > 0 && (candidate[v - 1].len < c.len ||
+                   (candidate[v - 1].len == c.len && candidate[v - 1].pos > c.pos))) {
+                candidate[v] = candidate[v - 1];
+                v--;
+            }
+            candidate[v] = c;
+        }
+        size_t closest = SIZE_MAX;
+        uint32_t n = 0;
+        for (uint32_t u = 0; u < candidates; u++) {
+            if (candidate[u].pos < closest) {
+                closest = candidate[u].pos;
+                candidate[n++] = candidate[u];
+            }
+        }
+        for (uint32_t u = n; u > 0; u--) {
+            lz77_found(f, candidate[u - 1].len, candidate[u - 1].pos);
+        }
+    }
+}
+
+// Finds longest match for data[i] in the window and inserts position `i`
+// into the finder. The match is returned in `len` and `pos` (distance)
+// with len == 0 if nothing was found. Positions must be visited in order
+// either by lz77_find() or lz77_skip().
+
+static void lz77_find(lz77_finder_t* f, size_t i, size_t* len, size_t* pos) {
+    lz77_assert(i == f->next);
+    *len = 0;
+    *pos = 0;
+    f->count = 0;
+    if (f->type == lz77_finder_chain) {
+        lz77_find_chain(f, i, len, pos);
+        lz77_insert(f, i);
+    } else if (f->type == lz77_finder_tree) {
+        if (i + lz77_hash_read(f->hash_len) <= f->bytes) {
+            lz77_tree_insert(f, i, len, pos);
+        }
+        // the tree is only searched up to `nice` bytes:
+        if (*len >= f->nice) {
+            const uint8_t* d = f->data + i;
+            *len += lz77_match_len(d - *pos + *len, d + *len,
+                                   f->bytes - i - *len);
+            lz77_found(f, *len, *pos);
+        }
+    } else if (f->type == lz77_finder_sa) {
+        lz77_find_sa(f, i, len, pos);
+    } else {
+        lz77_find_scan(f, i, len, pos);
+    }
+    f->next = i + 1;
+    // matches must not run into the next long distance match:
+    if (*len > f->end - i) {
+        const size_t n = f->end - i;
+        uint32_t c = 0;
+        while (c < f->count && f->matches[c].len < n) { c++; }
+        if (n < f->min_match) {
+            *len = 0;
+            *pos = 0;
+            f->count = 0;
+        } else {
+            *len = n;
+            if (c < f->count) {
+                *pos = f->matches[c].pos; // closest one that reaches `n`
+                f->matches[c].len = n;
+                f->count = c + 1;
+            }
+        }
+    }
+    if (*len < f->min_match) {
+        *len = 0;
+        *pos = 0;
+    }
+}
+
+// Inserts positions [f->next..end) without searching (e.g. covered by match)
+
+static void lz77_skip(lz77_finder_t* f, size_t end) {
+    // positions more than a window before `end` will never be matched:
+    if (end > f->next && end - f->next > f->window) {
+        f->next = end - f->window;
+    }
+    if (f->type == lz77_finder_chain || f->type == lz77_finder_tree) {
+        while (f->next < end) { lz77_insert(f, f->next); f->next++; }
+    }
+    f->next = end;
+}
+
+// Long distance matching pre-pass (rsync / zstd --long style): rolling
+// hash of every lz77_ldm_min bytes long chunk of the whole input. Only
+// chunks whose hash has lz77_ldm_sample low zero bits are remembered, so
+// the table holds a content defined sample of positions and the same
+// content is sampled at the same places in both copies. Candidates
+// closer than the window are left to the regular finder. Matches found
+// are extended both ways and returned in `far[]` in input order.
+
+enum {
+    lz77_ldm_min    = 64, // bytes hashed and minimum long distance match
+    lz77_ldm_sample = 4,  // remember 1 of 1 << lz77_ldm_sample chunks
+    lz77_ldm_bits   = 22  // maximum table[] size is 1 << lz77_ldm_bits
+};
+
+static const uint64_t lz77_ldm_prime = 0x9E3779B185EBCA87ULL;
+
+typedef struct lz77_far_s {
+    size_t at;  // position of the match in the input
+    size_t len;
+    size_t pos; // distance
+} lz77_far_t;
+
+static uint64_t lz77_ldm_hash(const uint8_t* p) {
+    uint64_t h = 0;
+    for (size_t k = 0; k < lz77_ldm_min; k++) {
+        h = h * lz77_ldm_prime + p[k] + 1;
+    }
+    return h;
+}
+
+static void lz77_ldm(lz77_t* lz, const uint8_t* data, size_t bytes,
+        size_t window, lz77_far_t* *far, size_t *count) {
+    *far = null;
+    *count = 0;
+    if (bytes < lz77_ldm_min * 2) { return; }
+    uint8_t bits = 10;
+    while (bits < lz77_ldm_bits &&
+           ((size_t)1 << (bits + lz77_ldm_sample)) < bytes) {
+        bits++;
+    }
+    uint64_t* table = (uint64_t*)calloc((size_t)1 << bits, sizeof(uint64_t));
+    if (table == null) { lz->error = ENOMEM; return; }
+    // `out` is prime ^ lz77_ldm_min to remove the oldest byte from hash
+    uint64_t out = 1;
+    for (size_t k = 0; k < lz77_ldm_min; k++) { out *= lz77_ldm_prime; }
+    const uint64_t sample = ((uint64_t)1 << lz77_ldm_sample) - 1;
+    size_t capacity = 0;
+    size_t last = 0; // end of the last long distance match
+    size_t i = 0;
+    uint64_t h = lz77_ldm_hash(data);
+    while (i + lz77_ldm_min <= bytes && lz->error == 0) {
+        // top bits index table[] and low bits decide sampling:
+        if ((h & sample) == 0) {
+            const size_t slot = (size_t)(h >> (64 - bits));
+            const uint64_t j1 = table[slot];
+            table[slot] = (uint64_t)i + 1;
+            const size_t j = (size_t)j1 - 1;
+            if (j1 != 0 && i - j >= window &&
+                memcmp(data + j, data + i, lz77_ldm_min) == 0) {
+                size_t at = i;
+                size_t from = j;
+                size_t len = lz77_ldm_min + lz77_match_len(
+                    data + j + lz77_ldm_min, data + i + lz77_ldm_min,
+                    bytes - i - lz77_ldm_min);
+                while (at > last && from > 0 && data[at - 1] == data[from - 1]) {
+                    at--;
+                    from--;
+                    len++;
+                }
+                if (*count == capacity) {
+                    capacity = capacity * 2 + 16;
+                    lz77_far_t* a = (lz77_far_t*)realloc(*far,
+                                    capacity * sizeof(lz77_far_t));
+                    if (a == null) { lz->error = ENOMEM; break; }
+                    *far = a;
+                }
+                (*far)[*count].at  = at;
+                (*far)[*count].len = len;
+                (*far)[*count].pos = at - from;
+                (*count)++;
+                last = at + len;
+                // continue hashing after the match:
+                i = last;
+                if (i + lz77_ldm_min <= bytes) { h = lz77_ldm_hash(data + i); }
+                continue;
+            }
+        }
+        if (i + lz77_ldm_min < bytes) {
+            h = h * lz77_ldm_prime - out * (data[i] + 1ULL) +
+                data[i + lz77_ldm_min] + 1;
+        }
+        i++;
+    }
+    free(table);
+    if (lz->error) { free(*far); *far = null; *count = 0; }
+}
+
+// Longest match at one of the repeat offsets `rep`. Verifying a handful
+// of known distances is much cheaper than walking a chain or a tree.
+
+static void lz77_find_rep(const lz77_finder_t* f, const size_t* rep,
+        size_t i, size_t* len, size_t* pos) {
+    const uint8_t* d = f->data + i;
+    const size_t n = f->end - i;
+    *len = 0;
+    *pos = 0;
+    if (n < f->min_match) { return; }
+    for (uint32_t k = 0; k < lz77_reps; k++) {
+        if (rep[k] <= i && rep[k] < f->window && *(d - rep[k]) == d[0]) {
+            const size_t l = lz77_match_len(d - rep[k], d, n);
+            if (l > *len) {
+                *len = l;
+                *pos = rep[k];
+            }
+        }
+    }
+    if (*len < f->min_match) {
+        *len = 0;
+        *pos = 0;
+    }
+}
+
+// Repeat offsets are tried first and the finder is only searched when
+// they do not give a `nice` match. Returns the match that saves more bits.
+
+static void lz77_find_best(lz77_finder_t* f, size_t i, size_t* len,
+        size_t* pos, lz77_code_t c) {
+    lz77_min_match_update(f, i, c);
+    lz77_find_rep(f, f->rep, i, len, pos);
+    if (*len >= f->nice) {
+        lz77_skip(f, i + 1);
+    } else {
+        size_t l = 0;
+        size_t p = 0;
+        lz77_find(f, i, &l, &p);
+        if (l > 0 && (*len == 0 ||
+            lz77_match_gain(f->rep, p, l, c) >
+            lz77_match_gain(f->rep, *pos, *len, c))) {
+            *len = l;
+            *pos = p;
+        }
+    }
+    // short far matches may cost more bits than the literals:
+    if (*len > 0 && lz77_match_gain(f->rep, *pos, *len, c) <= 0) {
+        *len = 0;
+        *pos = 0;
+    }
+}
+
+// Greedy and lazy parse of data[f->next..f->end): `lazy` is the number of
+// positions to look ahead for a better match before committing to the
+// one at `i`.
+// Incompressible data is stepped over LZ4 style: after every
+// 1 << f->skip failed searches in a row one more byte is emitted as
+// literal without searching (and without inserting it in the finder).
+
+static void lz77_compress_lazy(lz77_t* lz, lz77_finder_t* f,
+        uint64_t* b64, uint32_t* bp, lz77_code_t c, size_t lazy) {
+    const uint8_t* data = f->data;
+    const size_t bytes = f->end;
+    size_t i = f->next;
+    // bytes and position of longest matching sequence
+    size_t len = 0;
+    size_t pos = 0;
+    bool found = false; // `len` and `pos` already found for `i`
+    size_t misses = 0; // failed searches in a row
+    while (i < bytes && lz->error == 0) {
+        if (!found) { lz77_find_best(f, i, &len, &pos, c); }
+        found = false;
+        if (len > 0) {
+            // lazy evaluation: emit literal(s) if a match at i + 1 or i + 2
+            // saves more bits than the match at i
+            const int64_t gain = lz77_match_gain(f->rep, pos, len, c);
+            for (size_t k = 1; k <= lazy && len < f->nice && i + k < bytes; k++) {
+                size_t next_len = 0;
+                size_t next_pos = 0;
+                lz77_find_best(f, i + k, &next_len, &next_pos, c);
+                if (next_len > 0 &&
+                    lz77_match_gain(f->rep, next_pos, next_len, c) > gain) {
+                    while (k > 0) {
+                        lz77_write_literal(lz, b64, bp, data[i]);
+                        i++;
+                        k--;
+                    }
+                    len = next_len;
+                    pos = next_pos;
+                    found = true;
+                    break;
+                }
+            }
+            misses = 0;
+            if (!found) {
+                lz77_assert(0 < pos && pos < f->window);
+                lz77_write_match(lz, b64, bp, f->rep, pos, len, c);
+                lz77_histogram_pos_len(pos, len);
+                lz77_histogram_word(&data[i], len);
+                i += len;
+                lz77_skip(f, i);
+            }
+        } else {
+            size_t step = f->skip == 0 ? 1 : 1 + (misses >> f->skip);
+            if (step > bytes - i) { step = bytes - i; }
+            misses++;
+            while (step > 0) {
+                lz77_write_literal(lz, b64, bp, data[i]);
+                i++;
+                step--;
+            }
+            f->next = i;
+        }
+    }
+}
+
+// Optimal parse of data[f->next..f->end): shortest path (in bits) through
+// the blocks of lz77_opt_block positions where each position can be
+// reached by a literal or by any length of any match found by the finder.
+// Price of every step is the exact number of bits lz77_write_literal()
+// and lz77_write_match() will emit for it. A match of `nice` bytes or
+// longer ends the block early and is taken as is.
+
+typedef struct lz77_node_s {
+    uint32_t price; // bits from the start of the block; after backtracking
+                    // index of the next node on the shortest path
+    uint32_t len;   // of the step that reaches this node (1 for literal)
+    size_t   pos;   // distance of match step or 0 for literal
+    size_t   rep[lz77_reps]; // repeat offsets after the step
+} lz77_node_t;
+
+static void lz77_compress_optimal(lz77_t* lz, lz77_finder_t* f,
+        uint64_t* b64, uint32_t* bp, lz77_code_t c) {
+    const uint8_t* data = f->data;
+    const size_t bytes = f->end;
+    lz77_node_t* node = (lz77_node_t*)malloc(sizeof(lz77_node_t) *
+                                             (lz77_opt_block + 1));
+    f->matches = (lz77_match_t*)malloc(sizeof(lz77_match_t) *
+                                       lz77_max_matches);
+    if (node == null || f->matches == null) { lz->error = ENOMEM; }
+    size_t i = f->next;
+    while (i < bytes && lz->error == 0) {
+        const size_t n = bytes - i < lz77_opt_block ?
+                         bytes - i : lz77_opt_block;
+        node[0].price = 0;
+        memcpy(node[0].rep, f->rep, sizeof(node[0].rep));
+        for (size_t k = 1; k <= n; k++) { node[k].price = UINT32_MAX; }
+        size_t end = n;
+        size_t long_len = 0; // match of at least `nice` bytes at `end`
+        size_t long_pos = 0;
+        for (size_t k = 0; k < n; k++) {
+            size_t* rep = node[k].rep;
+            if (k > 0) { // cheapest step to `k` is final now
+                memcpy(rep, node[k - node[k].len].rep, sizeof(node[k].rep));
+                if (node[k].pos != 0) { lz77_rep_update(rep, node[k].pos); }
+            }
+            size_t len = 0;
+            size_t pos = 0;
+            lz77_min_match_update(f, i + k, c);
+            lz77_find(f, i + k, &len, &pos);
+            // taken without pricing thus only when cheaper than literals
+            // (a small caller set `nice` may be below that):
+            if (len >= f->nice && lz77_match_gain(rep, pos, len, c) > 0) {
+                end = k;
+                long_len = len;
+                long_pos = pos;
+                break;
+            }
+            const uint32_t price = node[k].price;
+            const uint32_t literal = price + (data[i + k] < 0x80 ? 8 : 9);
+            if (literal < node[k + 1].price) {
+                node[k + 1].price = literal;
+                node[k + 1].len = 1;
+                node[k + 1].pos = 0;
+            }
+            size_t rep_len = 0;
+            size_t rep_pos = 0;
+            lz77_find_rep(f, rep, i + k, &rep_len, &rep_pos);
+            if (rep_len > n - k) { rep_len = n - k; }
+            for (size_t l = f->min_match; l <= rep_len; l++) {
+                const uint32_t p = price +
+                                   lz77_match_bits(rep, rep_pos, l, c);
+                if (p < node[k + l].price) {
+                    node[k + l].price = p;
+                    node[k + l].len = (uint32_t)l;
+                    node[k + l].pos = rep_pos;
+                }
+            }
+            size_t l = f->min_match;
+            for (uint32_t m = 0; m < f->count; m++) {
+                const size_t d = f->matches[m].pos;
+                const size_t max_len = f->matches[m].len < n - k ?
+                                       f->matches[m].len : n - k;
+                while (l <= max_len) {
+                    const uint32_t p = price + lz77_match_bits(rep, d, l, c);
+                    if (p < node[k + l].price) {
+                        node[k + l].price = p;
+                        node[k + l].len = (uint32_t)l;
+                        node[k + l].pos = d;
+                    }
+                    l++;
+                }
+            }
+        }
+        // backtrack from `end` linking each node to the next one
+        size_t k = end;
+        while (k > 0) {
+            const size_t prev = k - node[k].len;
+            node[prev].price = (uint32_t)k;
+            k = prev;
+        }
+        while (k < end && lz->error == 0) {
+            const size_t next = node[k].price;
+            const size_t len = node[next].len;
+            const size_t pos = node[next].pos;
+            if (pos == 0) {
+                lz77_write_literal(lz, b64, bp, data[i + k]);
+            } else {
+                lz77_assert(0 < pos && pos < f->window);
+                lz77_write_match(lz, b64, bp, f->rep, pos, len, c);
+                lz77_histogram_pos_len(pos, len);
+                lz77_histogram_word(&data[i + k], len);
+            }
+            k = next;
+        }
+        i += end;
+        if (long_len > 0) {
+            lz77_write_match(lz, b64, bp, f->rep, long_pos, long_len, c);
+            lz77_histogram_pos_len(long_pos, long_len);
+            lz77_histogram_word(&data[i], long_len);
+            i += long_len;
+            lz77_skip(f, i);
+        }
+    }
+    free(f->matches);
+    f->matches = null;
+    free(node);
+}
+
+static void lz77_compress(lz77_t* lz, const uint8_t* data, size_t bytes,
+        uint8_t window_bits) {
+    lz77_if_error_return(lz);
+    if (window_bits < lz77_window_bits_min ||
+        window_bits > lz77_window_bits_max) {
+        lz77_return_invalid(lz);
+    }
+    if (lz->level > lz77_level_best) { lz77_return_invalid(lz); }
+    if (lz->parse > lz77_parse_optimal) { lz77_return_invalid(lz); }
+    if (lz->coding > lz77_coding_bucket) { lz77_return_invalid(lz); }
+    if (lz->min_match != 0 && lz->min_match != lz77_min_match_auto &&
+       (lz->min_match < lz77_min_match_min ||
+        lz->min_match > lz77_min_match_max)) {
+        lz77_return_invalid(lz);
+    }
+    lz77_init_histograms();
+    const size_t window = ((size_t)1U) << window_bits;
+    const lz77_code_t c = lz77_code(lz->coding, window_bits);
+    const uint8_t parse = lz->parse != 0 ? lz->parse : lz77_level(lz)->parse;
+    lz77_finder_t f;
+    lz77_finder_init(lz, &f, data, bytes, window);
+    const bool memory = lz->out != null; // see lz77_compress_to_buffer()
+    if (!memory) {
+        lz->out = (uint8_t*)malloc(lz77_span_bytes);
+        lz->out_bytes = 0;
+        lz->out_capacity = lz77_span_bytes;
+        if (lz->out == null && lz->error == 0) { lz->error = ENOMEM; }
+    }
+    if (lz->error) {
+        lz77_finder_fini(&f);
+        if (!memory) { free(lz->out); lz->out = null; }
+        return;
+    }
+    lz77_far_t* far = null;
+    size_t count = 0;
+    if (lz->long_distance) { lz77_ldm(lz, data, bytes, window, &far, &count); }
+    uint64_t b64 = 0;
+    uint32_t bp = 0;
+    // regular parse between long distance matches:
+    for (size_t k = 0; k <= count && lz->error == 0; k++) {
+        f.end = k < count ? far[k].at : bytes;
+        if (parse == lz77_parse_optimal) {
+            lz77_compress_optimal(lz, &f, &b64, &bp, c);
+        } else {
+            lz77_compress_lazy(lz, &f, &b64, &bp, c,
+                               parse - lz77_parse_greedy);
+        }
+        if (k < count) {
+            lz77_write_far(lz, &b64, &bp, far[k].pos, far[k].len, c);
+            f.end = bytes;
+            lz77_skip(&f, far[k].at + far[k].len);
+        }
+    }
+    free(far);
+    lz77_finder_fini(&f);
+    lz77_flush(lz, b64, bp);
+    if (!memory) { free(lz->out); lz->out = null; }
+    lz77_dump_histograms();
+}
+
+// Bit reader: `b64` holds the next bits of the stream least significant
+// first, `hi` the bits that follow them and `count` is the number of
+// valid bits in both (up to 120). lz77_peek() reads a word only when it
+// needs more bits than buffered, exactly where the writer crossed into
+// it, so nothing past the end of compressed data is ever requested.
+
+// Compressed input comes in spans from read_span(). Words that straddle
+// two spans and the 64 bit read() callback (a span of one word read on
+// demand) take the slow path. Without callbacks the only span is the
+// input of lz77_decompress_from_buffer().
+
+static uint64_t lz77_read_slow(lz77_t* lz) {
+    if (lz->read_span == null && lz->read != null) { return lz->read(lz); }
+    uint64_t w = 0;
+    size_t k = 0; // bytes of `w` filled
+    while (k < sizeof(w) && lz->error == 0) {
+        if (lz->span_bytes == 0) {
+            if (lz->read_span != null) {
+                lz->span = lz->read_span(lz, &lz->span_bytes);
+            }
+            if (lz->error == 0 && lz->span_bytes == 0) {
+                lz->error = EINVAL; // truncated compressed input
+            }
+        } else {
+            const size_t n = lz->span_bytes < sizeof(w) - k ?
+                             lz->span_bytes : sizeof(w) - k;
+            memcpy((uint8_t*)&w + k, lz->span, n);
+            lz->span += n;
+            lz->span_bytes -= n;
+            k += n;
+        }
+    }
+    return w;
+}
+
+static inline uint64_t lz77_read_word(lz77_t* lz) {
+    if (lz->span_bytes >= sizeof(uint64_t)) {
+        uint64_t w;
+        memcpy(&w, lz->span, sizeof(w));
+        lz->span += sizeof(w);
+        lz->span_bytes -= sizeof(w);
+        return w;
+    }
+    return lz77_read_slow(lz);
+}
+
+typedef struct lz77_bits_s {
+    uint64_t b64;
+    uint64_t hi;
+    uint32_t count;
+} lz77_bits_t;
+
+static inline uint64_t lz77_peek(lz77_t* lz, lz77_bits_t* r, uint32_t n) {
+    rt_assert(0 < n && n <= 57);
+    if (r->count < n) { // all buffered bits are in b64 and hi == 0
+        const uint64_t w = lz77_read_word(lz);
+        r->b64 |= w << r->count;
+        r->hi = r->count == 0 ? 0 : w >> (64 - r->count);
+        r->count += 64;
+    }
+    return r->b64 & (((uint64_t)1 << n) - 1);
+}
+
+static inline void lz77_consume(lz77_bits_t* r, uint32_t n) {
+    rt_assert(0 < n && n <= 57 && n <= r->count);
+    r->b64 = (r->b64 >> n) | (r->hi << (64 - n));
+    r->hi >>= n;
+    r->count -= n;
+}
+
+static inline uint64_t lz77_read_bits(lz77_t* lz, lz77_bits_t* r,
+        uint32_t n) {
+    const uint64_t bits = lz77_peek(lz, r, n);
+    lz77_consume(r, n);
+    return bits;
+}
+
+// Numbers are groups of `base` bits each followed by a continue bit and
+// every group is a single peek. 60-75% of the numbers in typical streams
+// are one group, most of the rest two or three, thus resolving all the
+// groups at once (ctz over the continue bits and pext, or a table of
+// the next 16..24 bits) does not pay for its setup: it measured 3-12%
+// slower than this loop.
+
+static inline uint64_t lz77_read_number(lz77_t* lz, lz77_bits_t* r,
+        uint8_t base) {
+    const uint64_t mask = ((uint64_t)1 << base) - 1;
+    uint64_t bits = 0;
+    uint32_t shift = 0;
+    for (;;) { // `base` bits and continue bit per group
+        const uint64_t group = lz77_read_bits(lz, r, base + 1);
+        // corrupt input may have more groups than fit in 64 bits, the
+        // shift wraps instead of a test and the caller checks the value
+        bits |= (group & mask) << (shift & 63);
+        if ((group >> base) == 0 || lz->error != 0) { break; }
+        shift += base;
+    }
+    return bits;
+}
+
+// lz77_write_bucket() decoded with a single count of trailing zeros over
+// the buffered bits (bits above `count` are always zero) that gives the
+// length of the whole code, then one peek and one consume. A run of
+// zeros past the buffered bits is the unary prefix going on, so reading
+// the next word is safe. Buckets wider than 57 bits are never written
+// and the stream is rejected.
+
+static uint64_t lz77_read_bucket_slow(lz77_t* lz, lz77_bits_t* r,
+        uint8_t k) {
+    if (r->b64 == 0 && r->count < 57) { lz77_peek(lz, r, r->count + 1); }
+    const uint64_t b = r->b64 & ((((uint64_t)1) << 57) - 1);
+    if (b == 0 || lz->error != 0) {
+        if (lz->error == 0) { lz->error = EINVAL; }
+        return 0;
+    }
+    const uint32_t z = lz77_ctz64(b);
+    const uint32_t n = z + k;
+    if (n > 57) { lz->error = EINVAL; return 0; }
+    lz77_consume(r, z + 1);
+    const uint64_t x = n > 0 ? lz77_read_bits(lz, r, n) : 0;
+    return x + ((uint64_t)1 << n) - ((uint64_t)1 << k);
+}
+
+static inline uint64_t lz77_read_bucket(lz77_t* lz, lz77_bits_t* r,
+        uint8_t k) {
+    lz77_peek(lz, r, 1);
+    if (r->b64 != 0) {
+        const uint32_t z = lz77_ctz64(r->b64);
+        const uint32_t n = z + k;
+        const uint32_t bits = z + 1 + n; // prefix and raw bits
+        if (bits <= 57) { // whole code is in the stream, read it at once
+            const uint64_t x = lz77_peek(lz, r, bits) >> (z + 1);
+            lz77_consume(r, bits);
+            return x + ((uint64_t)1 << n) - ((uint64_t)1 << k);
+        }
+    }
+    return lz77_read_bucket_slow(lz, r, k);
+}
+
+// Decoder refuses windows above `window_limit` so that streams from
+// untrusted sources cannot demand more memory than the caller expects.
+
+static inline uint8_t lz77_window_limit(const lz77_t* lz) {
+    return lz->window_limit != 0 && lz->window_limit < lz77_window_bits_max ?
+           lz->window_limit : lz77_window_bits_max;
+}
+
+static void lz77_read_header(lz77_t* lz, size_t *bytes, uint8_t *window_bits) {
+    lz77_if_error_return(lz);
+    *bytes = (size_t)lz77_read_word(lz);
+    const uint64_t format = lz77_read_word(lz);
+    lz77_if_error_return(lz);
+    *window_bits = (uint8_t)format;
+    const uint64_t coding = (format >> 8) & 0xFF;
+    const bool legacy = (format & lz77_header_reps) == 0;
+    if (*window_bits < lz77_window_bits_min ||
+        *window_bits > lz77_window_limit(lz) ||
+        coding > lz77_coding_bucket || (format >> 17) != 0 ||
+        (legacy && coding != lz77_coding_varint)) {
+        lz77_return_invalid(lz);
+    }
+    lz->coding = (uint8_t)coding;
+    lz->legacy = legacy;
+}
+
+// Match copy: data[i..i + len) from `pos` bytes back, where the source
+// overlaps the destination whenever pos < len. With at least
+// lz77_copy_slack bytes of output after the match the copy may write
+// past its end (the following tokens overwrite it):
+//   pos >= 16 (32)  16 (32) byte copies never read unwritten bytes;
+//   pos == 1        run of a single byte is memset();
+//   pos < 16        the first `pos` bytes repeated into a 16 byte pattern
+//                   (shuffle by lz77_pattern[pos]) are stored every
+//                   lz77_pattern_step[pos] bytes, a multiple of `pos`.
+// Near the end of the output bytes are copied one at a time.
+
+enum { lz77_copy_slack = 32 };
+
+static const uint8_t lz77_pattern[16][16] = { // [pos][k] = k % pos
+    {  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0 },
+    {  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0 },
+    {  0,  1,  0,  1,  0,  1,  0,  1,  0,  1,  0,  1,  0,  1,  0,  1 },
+    {  0,  1,  2,  0,  1,  2,  0,  1,  2,  0,  1,  2,  0,  1,  2,  0 },
+    {  0,  1,  2,  3,  0,  1,  2,  3,  0,  1,  2,  3,  0,  1,  2,  3 },
+    {  0,  1,  2,  3,  4,  0,  1,  2,  3,  4,  0,  1,  2,  3,  4,  0 },
+    {  0,  1,  2,  3,  4,  5,  0,  1,  2,  3,  4,  5,  0,  1,  2,  3 },
+    {  0,  1,  2,  3,  4,  5,  6,  0,  1,  2,  3,  4,  5,  6,  0,  1 },
+    {  0,  1,  2,  3,  4,  5,  6,  7,  0,  1,  2,  3,  4,  5,  6,  7 },
+    {  0,  1,  2,  3,  4,  5,  6,  7,  8,  0,  1,  2,  3,  4,  5,  6 },
+    {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9,  0,  1,  2,  3,  4,  5 },
+    {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10,  0,  1,  2,  3,  4 },
+    {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11,  0,  1,  2,  3 },
+    {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12,  0,  1,  2 },
+    {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13,  0,  1 },
+    {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,  0 }
+};
+
+static const uint8_t lz77_pattern_step[16] = { // 16 - 16 % pos
+    0, 16, 16, 15, 16, 15, 12, 14, 16, 9, 10, 11, 12, 13, 14, 15
+};
+
+static inline void lz77_copy(uint8_t* data, size_t i, size_t pos,
+        size_t len, size_t bytes) {
+    uint8_t* d = data + i;
+    const uint8_t* s = d - pos;
+    if (bytes - i - len < lz77_copy_slack) {
+        for (size_t k = 0; k < len; k++) { d[k] = s[k]; }
+    } else if (pos >= 16) {
+        size_t k = 0;
+        #ifdef lz77_avx2
+        if (pos >= 32) {
+            for (;;) {
+                _mm256_storeu_si256((__m256i*)(d + k),
+                    _mm256_loadu_si256((const __m256i*)(s + k)));
+                k += 32;
+                if (k >= len) { return; }
+            }
+        }
+        #endif
+        for (;;) {
+            memcpy(d + k, s + k, 16);
+            k += 16;
+            if (k >= len) { break; }
+        }
+    } else if (pos == 1) {
+        memset(d, s[0], len);
+    } else {
+        uint8_t p[16];
+        #ifdef lz77_avx2 // pshufb (SSSE3) comes with AVX2
+            const __m128i v = _mm_loadu_si128((const __m128i*)s);
+            const __m128i x = _mm_loadu_si128(
+                                  (const __m128i*)lz77_pattern[pos]);
+            _mm_storeu_si128((__m128i*)p, _mm_shuffle_epi8(v, x));
+        #else
+            for (size_t k = 0; k < 16; k++) { p[k] = s[lz77_pattern[pos][k]]; }
+        #endif
+        const size_t step = lz77_pattern_step[pos];
+        for (size_t k = 0; k < len; k += step) { memcpy(d + k, p, 16); }
+    }
+}
+
+// Decoding is two stages per batch of tokens: lz77_parse() resolves the
+// bit stream into sequences of a literal run followed by a match and
+// lz77_execute() writes them to the output. Parsing is a serial chain
+// of bit reads while execution is plain memory copies that can be wide
+// and know the sources of the next matches in advance (prefetched).
+
+enum {
+    lz77_batch_seqs     = 256,  // sequences per batch
+    lz77_batch_literals = 4096  // literal bytes per batch
+};
+
+typedef struct lz77_seq_s {
+    size_t lits; // literal run length
+    size_t pos;  // match distance
+    size_t len;  // match length, 0 for a trailing literal run
+} lz77_seq_t;
+
+typedef struct lz77_batch_s {
+    lz77_seq_t seq[lz77_batch_seqs];
+    uint8_t    literal[lz77_batch_literals + 16]; // + slack for 16 byte copies
+    // counters live in the decoder's locals while parsing because byte
+    // stores to literal[] could alias them:
+    size_t     count; // of seq[] in use
+    size_t     run;   // literals after the last match in seq[]
+} lz77_batch_t;
+
+// The parser runs in two modes. While lz77_token_bytes of compressed
+// input are left in the span no read inside a valid token can fail or
+// take the slow path, thus the fast mode tests lz->error once per token
+// instead of after every field. Tokens near the end of a span and all
+// tokens read through the read() callback are fully checked. Distances
+// and lengths are range checked against the output position `*at` in
+// both modes: that is what keeps corrupt input inside data[0..bytes)
+// even when a failed read in fast mode leaves a garbage value behind.
+// `bucket` and `checked` are constants at every call site, so each
+// combination gets its own code without per field tests.
+
+enum { lz77_token_bytes = 64 }; // more than the longest valid token
+
+static lz77_force_inline void lz77_parse(lz77_t* lz, lz77_bits_t* r,
+        lz77_batch_t* b, size_t* count, size_t* lits, size_t* run,
+        size_t* at, size_t bytes, size_t window, size_t* rep,
+        lz77_code_t c, bool bucket, bool checked) {
+    const size_t i = *at;
+    // ASCII literal is the shortest token (8 bits) all others are
+    // longer thus peeking 8 bits never reads past the end of stream
+    const uint64_t flags = lz77_peek(lz, r, 8);
+    if (checked && lz->error != 0) { return; }
+    if ((flags & 1) == 0) { // ASCII byte < 0x80
+        lz77_consume(r, 8);
+        b->literal[(*lits)++] = (uint8_t)(flags >> 1);
+        (*run)++;
+        *at = i + 1;
+    } else if ((flags & 2) == 0) { // byte >= 0x80
+        const uint64_t v = lz77_read_bits(lz, r, 9);
+        if (checked && lz->error != 0) { return; }
+        b->literal[(*lits)++] = (uint8_t)(v >> 2) | 0x80;
+        (*run)++;
+        *at = i + 1;
+    } else {
+        lz77_consume(r, 2);
+        uint64_t pos = bucket ? lz77_read_bucket(lz, r, c.pos_k) :
+                                lz77_read_number(lz, r, c.base);
+        if (checked && lz->error != 0) { return; }
+        uint64_t len = 0;
+        if (pos == 0) { // long distance match
+            pos = lz77_read_number(lz, r, lz77_far_base);
+            if (checked && lz->error != 0) { return; }
+            len = lz77_read_number(lz, r, lz77_far_base);
+            if (checked && lz->error != 0) { return; }
+            if (!(0 < pos && pos <= i)) { lz77_return_invalid(lz); }
+        } else {
+            pos = pos <= c.reps ? rep[pos - 1] : pos - c.reps;
+            len = bucket ? lz77_read_bucket(lz, r, c.len_k) :
+                           lz77_read_number(lz, r, c.base);
+            if (checked && lz->error != 0) { return; }
+            if (!(0 < pos && pos < window && pos <= i)) {
+                lz77_return_invalid(lz);
+            }
+            lz77_rep_update(rep, (size_t)pos);
+        }
+        if (len == 0 || len > bytes - i) { lz77_return_invalid(lz); }
+        lz77_seq_t* s = &b->seq[(*count)++];
+        s->lits = *run;
+        s->pos  = (size_t)pos;
+        s->len  = (size_t)len;
+        *run = 0;
+        *at = i + (size_t)len;
+    }
+}
+
+// Literal runs are copied 16 bytes at a time while the output has room
+// for it (the following match overwrites the excess).
+
+static void lz77_execute(uint8_t* data, size_t i, size_t bytes,
+        const lz77_batch_t* b) {
+    const uint8_t* literal = b->literal;
+    for (size_t k = 0; k < b->count; k++) {
+        const lz77_seq_t* s = &b->seq[k];
+        if (k + 1 < b->count) {
+            const lz77_seq_t* n = &b->seq[k + 1];
+            lz77_prefetch(data + i + s->lits + s->len + n->lits - n->pos);
+        }
+        if (bytes - i - s->lits >= 16) {
+            for (size_t j = 0; j < s->lits; j += 16) {
+                memcpy(data + i + j, literal + j, 16);
+            }
+        } else {
+            memcpy(data + i, literal, s->lits);
+        }
+        literal += s->lits;
+        i += s->lits;
+        lz77_copy(data, i, s->pos, s->len, bytes);
+        i += s->len;
+    }
+    memcpy(data + i, literal, b->run);
+}
+
+// Parses tokens into `b` until it is full or all `bytes` of output
+// are parsed, `*at` is the output position after the parsed tokens.
+
+static lz77_force_inline void lz77_parse_batch(lz77_t* lz, lz77_bits_t* r,
+        lz77_batch_t* b, size_t* at, size_t bytes, size_t window,
+        size_t* rep, lz77_code_t c, bool bucket) {
+    size_t i = *at;
+    size_t count = 0;
+    size_t lits = 0;
+    size_t run = 0;
+    for (;;) {
+        const size_t seqs = lz77_batch_seqs - count;
+        const size_t room = lz77_batch_literals - lits < seqs ?
+                            lz77_batch_literals - lits : seqs;
+        if (room == 0 || i >= bytes || lz->error != 0) { break; }
+        // each token takes less than lz77_token_bytes of the span:
+        size_t fast = lz->span_bytes / lz77_token_bytes;
+        if (fast > room) { fast = room; }
+        if (fast == 0) {
+            lz77_parse(lz, r, b, &count, &lits, &run, &i, bytes,
+                       window, rep, c, bucket, true);
+        }
+        for (size_t k = 0; k < fast && i < bytes && lz->error == 0; k++) {
+            lz77_parse(lz, r, b, &count, &lits, &run, &i, bytes,
+                       window, rep, c, bucket, false);
+        }
+    }
+    b->count = count;
+    b->run = run;
+    *at = i;
+}
+
+static lz77_force_inline void lz77_decode(lz77_t* lz, uint8_t* data,
+        size_t bytes, uint8_t window_bits, bool bucket) {
+    const size_t window = ((size_t)1U) << window_bits;
+    lz77_code_t c = lz77_code(lz->coding, window_bits);
+    if (lz->legacy) { c.reps = 0; }
+    size_t rep[lz77_reps]; // repeat offsets
+    memcpy(rep, lz77_rep_start, sizeof(rep));
+    lz77_batch_t* b = (lz77_batch_t*)malloc(sizeof(lz77_batch_t));
+    if (b == null) { lz->error = ENOMEM; return; }
+    size_t i = 0; // output data[i] after the parsed tokens
+    lz77_bits_t r = { 0 };
+    while (i < bytes && lz->error == 0) {
+        const size_t start = i;
+        lz77_parse_batch(lz, &r, b, &i, bytes, window, rep, c, bucket);
+        if (lz->error == 0) { lz77_execute(data, start, bytes, b); }
+    }
+    free(b);
+}
+
+static void lz77_decompress(lz77_t* lz, uint8_t* data, size_t bytes,
+        uint8_t window_bits) {
+    lz77_if_error_return(lz);
+    if (window_bits < lz77_window_bits_min ||
+        window_bits > lz77_window_limit(lz)) {
+        lz77_return_invalid(lz);
+    }
+    if (lz->coding == lz77_coding_bucket) {
+        lz77_decode(lz, data, bytes, window_bits, true);
+    } else if (lz->coding == lz77_coding_varint) {
+        lz77_decode(lz, data, bytes, window_bits, false);
+    } else {
+        lz77_return_invalid(lz);
+    }
+}
+
+// Literals take at most 9 bits and every match or long distance match
+// takes fewer bits than the literals it replaces (lz77_find_best(), the
+// prices of lz77_compress_optimal() and lz77_ldm_min) so the output
+// never exceeds 9 bits per input byte plus the header and the last
+// partial word.
+
+static size_t lz77_compress_bound(size_t bytes, uint8_t window_bits) {
+    (void)window_bits; // the bound holds for any window
+    return 2 * sizeof(uint64_t) + bytes + bytes / 8 + 1 + sizeof(uint64_t);
+}
+
+static errno_t lz77_compress_to_buffer(const lz77_t* parameters,
+        const uint8_t* data, size_t bytes, uint8_t window_bits,
+        uint8_t* out, size_t capacity, size_t* written) {
+    lz77_t lz = { 0 };
+    if (parameters != null) {
+        lz.level         = parameters->level;
+        lz.finder        = parameters->finder;
+        lz.parse         = parameters->parse;
+        lz.chain         = parameters->chain;
+        lz.nice          = parameters->nice;
+        lz.min_match     = parameters->min_match;
+        lz.long_distance = parameters->long_distance;
+        lz.coding        = parameters->coding;
+    }
+    *written = 0;
+    const uint64_t header[2] = {
+        (uint64_t)bytes, lz77_header_format(&lz, window_bits)
+    };
+    if (window_bits < lz77_window_bits_min ||
+        window_bits > lz77_window_bits_max ||
+        lz.coding > lz77_coding_bucket) {
+        return EINVAL;
+    }
+    if (capacity < sizeof(header)) { return ENOBUFS; }
+    memcpy(out, header, sizeof(header));
+    // compressed words are written straight into `out`:
+    lz.out = out + sizeof(header);
+    lz.out_capacity = (capacity - sizeof(header)) / 8 * 8;
+    lz77_compress(&lz, data, bytes, window_bits);
+    if (lz.error == 0) { *written = sizeof(header) + (size_t)lz.written; }
+    return lz.error;
+}
+
+static errno_t lz77_decompress_from_buffer(const lz77_t* parameters,
+        const uint8_t* in, size_t in_bytes, uint8_t* data, size_t capacity,
+        size_t* bytes) {
+    lz77_t lz = { 0 };
+    if (parameters != null) { lz.window_limit = parameters->window_limit; }
+    lz.span = in;
+    lz.span_bytes = in_bytes;
+    uint8_t window_bits = 0;
+    *bytes = 0;
+    lz77_read_header(&lz, bytes, &window_bits);
+    if (lz.error != 0) { *bytes = 0; return lz.error; }
+    if (*bytes > capacity) { return ENOBUFS; }
+    lz77_decompress(&lz, data, *bytes, window_bits);
+    return lz.error;
+}
+
+// Streaming decompression executes the parsed batches into a ring of
+// two windows instead of the whole output. Every regular match reaches
+// at most a window back, so once ring[] is decoded and delivered its
+// upper half is moved down and the lower half is the history. Literal
+// runs and matches are split wherever ring[] or the caller's chunk
+// ends. Long distance matches reach further back than the window and
+// fail with ENOTSUP.
+
+struct lz77_stream_s {
+    lz77_bits_t    r;
+    size_t         rep[lz77_reps];
+    lz77_code_t    c;
+    bool           bucket;
+    size_t         window;
+    size_t         bytes;   // of the whole output
+    size_t         parsed;  // output bytes parsed into batches so far
+    size_t         done;    // output bytes delivered to the caller
+    size_t         k;       // next b.seq[k], b.count is the trailing run
+    const uint8_t* literal; // next literal in b.literal[]
+    size_t         lits;    // literals of the current sequence left
+    size_t         pos;
+    size_t         len;     // match bytes of the current sequence left
+    size_t         size;    // of ring[] min(2 * window, bytes)
+    size_t         at;      // ring[at] is the next byte to decode
+    size_t         out;     // ring[out] is the next byte to deliver
+    uint8_t*       ring;    // follows the structure in the same allocation
+    lz77_batch_t   b;
+};
+
+static void lz77_decompress_close(lz77_t* lz) {
+    free(lz->stream);
+    lz->stream = null;
+}
+
+static void lz77_decompress_open(lz77_t* lz, size_t bytes,
+        uint8_t window_bits) {
+    lz77_decompress_close(lz);
+    lz77_if_error_return(lz);
+    if (window_bits < lz77_window_bits_min ||
+        window_bits > lz77_window_limit(lz) ||
+        lz->coding > lz77_coding_bucket) {
+        lz77_return_invalid(lz);
+    }
+    const size_t window = ((size_t)1U) << window_bits;
+    const size_t size = bytes < 2 * window ? bytes : 2 * window;
+    lz77_stream_t* s = (lz77_stream_t*)malloc(sizeof(lz77_stream_t) + size);
+    if (s == null) { lz->error = ENOMEM; return; }
+    memset(s, 0, sizeof(*s));
+    memcpy(s->rep, lz77_rep_start, sizeof(s->rep));
+    s->c = lz77_code(lz->coding, window_bits);
+    if (lz->legacy) { s->c.reps = 0; }
+    s->bucket = lz->coding == lz77_coding_bucket;
+    s->window = window;
+    s->bytes = bytes;
+    s->k = 1; // past the (empty) trailing run: parse the first batch
+    s->size = size;
+    s->ring = (uint8_t*)(s + 1);
+    lz->stream = s;
+}
+
+static void lz77_stream_parse(lz77_t* lz, lz77_stream_t* s) {
+    if (s->bucket) {
+        lz77_parse_batch(lz, &s->r, &s->b, &s->parsed, s->bytes, s->window,
+                         s->rep, s->c, true);
+    } else {
+        lz77_parse_batch(lz, &s->r, &s->b, &s->parsed, s->bytes, s->window,
+                         s->rep, s->c, false);
+    }
+    s->k = 0;
+    s->literal = s->b.literal;
+}
+
+static void lz77_stream_fill(lz77_t* lz, lz77_stream_t* s, size_t end) {
+    while (s->at < end && lz->error == 0) {
+        if (s->lits > 0) {
+            const size_t n = s->lits < end - s->at ? s->lits : end - s->at;
+            memcpy(s->ring + s->at, s->literal, n);
+            s->literal += n;
+            s->lits -= n;
+            s->at += n;
+        } else if (s->len > 0) {
+            const size_t n = s->len < end - s->at ? s->len : end - s->at;
+            lz77_copy(s->ring, s->at, s->pos, n, s->size);
+            s->len -= n;
+            s->at += n;
+        } else if (s->k < s->b.count) {
+            const lz77_seq_t* q = &s->b.seq[s->k++];
+            if (q->pos >= s->window) { lz->error = ENOTSUP; return; }
+            s->lits = q->lits;
+            s->pos  = q->pos;
+            s->len  = q->len;
+        } else if (s->k == s->b.count) {
+            s->k++;
+            s->lits = s->b.run;
+        } else if (s->parsed < s->bytes) {
+            lz77_stream_parse(lz, s);
+        } else {
+            break;
+        }
+    }
+}
+
+static size_t lz77_decompress_read(lz77_t* lz, uint8_t* data,
+        size_t capacity) {
+    lz77_stream_t* s = lz->stream;
+    if (s == null && lz->error == 0) { lz->error = EINVAL; }
+    size_t n = 0;
+    while (n < capacity && lz->error == 0 && s->done < s->bytes) {
+        if (s->out < s->at) {
+            const size_t k = s->at - s->out < capacity - n ?
+                             s->at - s->out : capacity - n;
+            memcpy(data + n, s->ring + s->out, k);
+            s->out += k;
+            s->done += k;
+            n += k;
+        } else {
+            if (s->at == s->size) { // keep the last window as history
+                memcpy(s->ring, s->ring + s->window, s->window);
+                s->at = s->window;
+                s->out = s->window;
+            }
+            const size_t end = capacity - n < s->size - s->at ?
+                               s->at + capacity - n : s->size;
+            lz77_stream_fill(lz, s, end);
+        }
     }
+    return n;
 }
 
 lz77_if lz77 = {
-    .write_header = lz77_write_header,
-    .compress     = lz77_compress,
-    .read_header  = lz77_read_header,
-    .decompress   = lz77_decompress,
+    .write_header           = lz77_write_header,
+    .compress               = lz77_compress,
+    .read_header            = lz77_read_header,
+    .decompress             = lz77_decompress,
+    .compress_bound         = lz77_compress_bound,
+    .compress_to_buffer     = lz77_compress_to_buffer,
+    .decompress_from_buffer = lz77_decompress_from_buffer,
+    .decompress_open        = lz77_decompress_open,
+    .decompress_read        = lz77_decompress_read,
+    .decompress_close       = lz77_decompress_close,
 };
 
 #endif // lz77_implementation
@@ -16,6 +16,7 @@
 
 #include "lz77.h"
 #include "rt.h"
+#include <time.h>
 
 enum { lzn_window_bits = 11 };
 
@@ -42,12 +43,40 @@ static void file_write(lz77_t* lz, uint64_t buffer) {
     }
 }
 
+static uint8_t file_span[lz77_span_bytes]; // file_read_span() buffer
+
+static const uint8_t* file_read_span(lz77_t* lz, size_t* bytes) {
+    *bytes = 0;
+    if (lz->error == 0) {
+        FILE* f = (FILE*)lz->that;
+        *bytes = fread(file_span, 1, sizeof(file_span), f);
+        if (*bytes == 0 && ferror(f)) { lz->error = errno; }
+    }
+    return file_span;
+}
+
+static void file_write_span(lz77_t* lz, const uint8_t* data, size_t bytes) {
+    if (lz->error == 0) {
+        FILE* f = (FILE*)lz->that;
+        if (fwrite(data, 1, bytes, f) != bytes) {
+            lz->error = errno;
+        }
+    }
+}
+
 static bool file_exist(const char* filename) {
     struct stat st = {0};
     return stat(filename, &st) == 0;
 }
 
 static const char* input_file;
+static uint8_t level;  // compression level (0 default)
+static uint8_t finder; // lz77_finder_*
+static uint8_t window_bits = lzn_window_bits;
+static bool long_distance;
+static bool word_io; // 64 bit read()/write() callbacks instead of spans
+static uint8_t coding; // lz77_coding_*
+static uint32_t nice;  // 0 default for the level
 
 static errno_t compress(const char* fn, const uint8_t* data, size_t bytes) {
     FILE* out = null; // compressed file
@@ -58,10 +87,16 @@ static errno_t compress(const char* fn, const uint8_t* data, size_t bytes) {
     }
     lz77_t lz = {
         .that = (void*)out,
-        .write = file_write
+        .write = file_write,
+        .write_span = word_io ? null : file_write_span,
+        .level = level,
+        .finder = finder,
+        .long_distance = long_distance,
+        .coding = coding,
+        .nice = nice
     };
-    lz77.write_header(&lz, bytes, lzn_window_bits);
-    lz77.compress(&lz, data, bytes, lzn_window_bits);
+    lz77.write_header(&lz, bytes, window_bits);
+    lz77.compress(&lz, data, bytes, window_bits);
     rt_assert(lz.error == 0);
     r = fclose(out) == 0 ? 0 : errno; // e.g. overflow writing buffered output
     if (r != 0) {
@@ -94,12 +129,14 @@ static errno_t verify(const char* fn, const uint8_t* input, size_t size) {
     }
     lz77_t lz = {
         .that = (void*)in,
-        .read = file_read
+        .read = file_read,
+        .read_span = word_io ? null : file_read_span
     };
     size_t bytes = 0;
-    uint8_t window_bits = 0;
-    lz77.read_header(&lz, &bytes, &window_bits);
-    rt_assert(lz.error == 0 && bytes == size && window_bits == lzn_window_bits);
+    uint8_t wb = 0;
+    lz77.read_header(&lz, &bytes, &wb);
+    rt_assert(lz.error == 0 && bytes == size && wb == window_bits &&
+              lz.coding == coding);
     uint8_t* data = (uint8_t*)malloc(bytes + 1);
     if (data == null) {
         rt_println("Failed to allocate memory for decompressed data");
@@ -107,7 +144,7 @@ static errno_t verify(const char* fn, const uint8_t* input, size_t size) {
         return ENOMEM;
     }
     data[bytes] = 0x00;
-    lz77.decompress(&lz, data, bytes, lzn_window_bits);
+    lz77.decompress(&lz, data, bytes, wb);
     fclose(in);
     rt_assert(lz.error == 0);
     if (lz.error == 0) {
@@ -128,6 +165,45 @@ static errno_t verify(const char* fn, const uint8_t* input, size_t size) {
     return r;
 }
 
+static errno_t verify_stream(const char* fn, const uint8_t* input,
+        size_t size) {
+    // decompress in odd sized chunks through the ring buffer decoder
+    FILE* in = null; // compressed file
+    errno_t r = fopen_s(&in, fn, "rb");
+    if (r != 0 || in == null) {
+        rt_println("Failed to open \"%s\"", fn);
+        return r;
+    }
+    lz77_t lz = {
+        .that = (void*)in,
+        .read = file_read,
+        .read_span = word_io ? null : file_read_span
+    };
+    size_t bytes = 0;
+    uint8_t wb = 0;
+    lz77.read_header(&lz, &bytes, &wb);
+    lz77.decompress_open(&lz, bytes, wb);
+    uint8_t chunk[1000];
+    size_t done = 0;
+    while (done < bytes && lz.error == 0) {
+        const size_t n = lz77.decompress_read(&lz, chunk, sizeof(chunk));
+        if (done + n > size || memcmp(input + done, chunk, n) != 0) {
+            rt_println("decompress_read() and compress() are not the same");
+            r = ENODATA;
+            break;
+        }
+        done += n;
+    }
+    lz77.decompress_close(&lz);
+    fclose(in);
+    if (r == 0) { r = lz.error; }
+    rt_assert(r == 0);
+    if (r != 0) {
+        rt_println("Failed to decompress stream: %s", strerror(r));
+    }
+    return r;
+}
+
 static errno_t file_size(FILE* f, size_t* size) {
     // on error returns (fpos_t)-1 and sets errno
     fpos_t pos = 0;
@@ -171,16 +247,206 @@ static errno_t read_whole_file(const char* fn, const uint8_t* *data, size_t *byt
     return fclose(f) == 0 ? 0 : errno;
 }
 
+static errno_t test_buffer(const uint8_t* data, size_t bytes) {
+    // memory to memory round trip, output must fit compress_bound()
+    // and must not fit into one word less than its size
+    const lz77_t parameters = {
+        .level = level,
+        .finder = finder,
+        .long_distance = long_distance,
+        .coding = coding,
+        .nice = nice
+    };
+    const size_t capacity = lz77.compress_bound(bytes, window_bits);
+    uint8_t* out = (uint8_t*)malloc(capacity);
+    uint8_t* data2 = (uint8_t*)malloc(bytes + 1);
+    if (out == null || data2 == null) {
+        free(out);
+        free(data2);
+        return ENOMEM;
+    }
+    size_t written = 0;
+    errno_t r = lz77.compress_to_buffer(&parameters, data, bytes,
+                    window_bits, out, capacity, &written);
+    rt_assert(r == 0 && written <= capacity);
+    if (r == 0 && written > 2 * sizeof(uint64_t)) {
+        size_t small = 0;
+        r = lz77.compress_to_buffer(&parameters, data, bytes,
+                window_bits, out, written - 1, &small);
+        rt_assert(r == ENOBUFS && small == 0);
+        r = r == ENOBUFS ? lz77.compress_to_buffer(&parameters, data, bytes,
+                window_bits, out, written, &small) : EINVAL;
+    }
+    size_t decompressed = 0;
+    if (r == 0) {
+        r = lz77.decompress_from_buffer(null, out, written, data2, bytes,
+                                        &decompressed);
+        rt_assert(r == 0);
+    }
+    if (r == 0 && (decompressed != bytes ||
+                   memcmp(data, data2, bytes) != 0)) {
+        rt_println("compress_to_buffer() and decompress_from_buffer() "
+                   "are not the same");
+        r = ENODATA;
+    }
+    if (r == 0 && written > 2 * sizeof(uint64_t)) {
+        // truncated input must be rejected without reading past its end
+        r = lz77.decompress_from_buffer(null, out, written - 8, data2,
+                                        bytes, &decompressed);
+        rt_assert(r == EINVAL);
+        r = r == EINVAL ? 0 : ENODATA;
+    }
+    free(out);
+    free(data2);
+    return r;
+}
+
+static errno_t test_legacy(void) {
+    // stream written before repeat offsets: window_bits 10 header word
+    // without the repeat offsets bit, literals "abc" and match (3, 6)
+    const uint64_t stream[3] = { 9, 10, 0x18FC6C4C2ULL };
+    uint8_t data[9 + 1] = { 0 };
+    size_t bytes = 0;
+    errno_t r = lz77.decompress_from_buffer(null, (const uint8_t*)stream,
+                    sizeof(stream), data, sizeof(data) - 1, &bytes);
+    rt_assert(r == 0 && bytes == 9 && memcmp(data, "abcabcabc", 9) == 0);
+    if (r == 0 && (bytes != 9 || memcmp(data, "abcabcabc", 9) != 0)) {
+        rt_println("legacy stream decoded wrong: %s", data);
+        r = ENODATA;
+    }
+    return r;
+}
+
+typedef struct buffer_s {
+    const uint8_t* data;
+    size_t bytes;
+} buffer_t;
+
+static const uint8_t* buffer_read_span(lz77_t* lz, size_t* bytes) {
+    // whole buffer as a single span then end of input
+    buffer_t* b = (buffer_t*)lz->that;
+    const uint8_t* data = b->data;
+    *bytes = b->bytes;
+    b->bytes = 0;
+    return data;
+}
+
+static errno_t test_far(void) {
+    // the same 64KB random block twice 128KB apart is far beyond the
+    // window and can only be matched by a long distance match
+    enum { block = 64 * 1024, bytes = 3 * block, wb = 11 };
+    uint8_t* data = (uint8_t*)malloc(bytes);
+    const size_t capacity = lz77.compress_bound(bytes, wb);
+    uint8_t* out = (uint8_t*)malloc(capacity);
+    uint8_t* data2 = (uint8_t*)malloc(bytes);
+    if (data == null || out == null || data2 == null) {
+        free(data);
+        free(out);
+        free(data2);
+        return ENOMEM;
+    }
+    uint32_t seed = 1;
+    for (size_t i = 0; i < 2 * block; i++) {
+        seed = seed * 1664525 + 1013904223;
+        data[i] = (uint8_t)(seed >> 24);
+    }
+    memcpy(data + 2 * block, data, block);
+    errno_t r = 0;
+    for (int ldm = 0; ldm <= 1 && r == 0; ldm++) {
+        const lz77_t parameters = { .long_distance = ldm != 0 };
+        size_t written = 0;
+        r = lz77.compress_to_buffer(&parameters, data, bytes, wb,
+                                    out, capacity, &written);
+        // random bytes take more than 8 bits each without a far match:
+        if (r == 0 && ldm && written > 2 * block + block / 4) {
+            rt_println("no long distance match: %lld bytes",
+                       (int64_t)written);
+            r = ENODATA;
+        }
+        size_t decompressed = 0;
+        if (r == 0) {
+            r = lz77.decompress_from_buffer(null, out, written, data2,
+                                            bytes, &decompressed);
+        }
+        if (r == 0 && (decompressed != bytes ||
+                       memcmp(data, data2, bytes) != 0)) {
+            rt_println("long distance match decompressed wrong");
+            r = ENODATA;
+        }
+        if (r == 0) {
+            // far matches are further back than the ring buffer keeps
+            buffer_t in = { out, written };
+            lz77_t lz = { .that = &in, .read_span = buffer_read_span };
+            size_t n = 0;
+            uint8_t window_bits = 0;
+            lz77.read_header(&lz, &n, &window_bits);
+            lz77.decompress_open(&lz, n, window_bits);
+            size_t done = 0;
+            while (done < n && lz.error == 0) {
+                done += lz77.decompress_read(&lz, data2 + done, 1000);
+            }
+            lz77.decompress_close(&lz);
+            const errno_t expected = ldm ? ENOTSUP : 0;
+            if (lz.error != expected ||
+                memcmp(data, data2, done) != 0) {
+                rt_println("decompress_read() %s instead of %s",
+                           strerror(lz.error), strerror(expected));
+                r = ENODATA;
+            }
+        }
+    }
+    rt_assert(r == 0);
+    free(data);
+    free(out);
+    free(data2);
+    return r;
+}
+
+static errno_t test_small_nice(void) {
+    // random bytes >= 0x80 are 9 bit literals that short matches found
+    // by a small `nice` do not pay for: output must fit compress_bound()
+    enum { bytes = 64 * 1024 };
+    uint8_t* data = (uint8_t*)malloc(bytes);
+    if (data == null) { return ENOMEM; }
+    uint32_t seed = 1;
+    for (size_t i = 0; i < bytes; i++) {
+        seed = seed * 1664525 + 1013904223;
+        data[i] = (uint8_t)(0x80 | (seed >> 24));
+    }
+    errno_t r = 0;
+    level = lz77_level_best - 1; // optimal parse
+    window_bits = 20;
+    nice = 3;
+    for (coding = lz77_coding_varint; coding <= lz77_coding_bucket; coding++) {
+        if (r == 0) { r = test_buffer(data, bytes); }
+    }
+    coding = lz77_coding_varint;
+    nice = 0;
+    window_bits = lzn_window_bits;
+    level = 0;
+    free(data);
+    return r;
+}
+
 static errno_t test(const uint8_t* data, size_t bytes) {
     const char* compressed = "~compressed~.bin";
     errno_t r = compress(compressed, data, bytes);
     if (r == 0) {
         r = verify(compressed, data, bytes);
     }
+    if (r == 0) {
+        r = verify_stream(compressed, data, bytes);
+    }
     (void)remove(compressed);
+    if (r == 0) {
+        r = test_buffer(data, bytes);
+    }
     return r;
 }
 
+static void hash_benchmark(void); // needs lz77 implementation (see below)
+static errno_t test_sa_finder(const uint8_t* data, size_t bytes);
+
 static errno_t test_compression(const char* fn) {
     errno_t r = 0;
     uint8_t* data = null;
@@ -214,6 +480,69 @@ int main(int argc, const char* argv[]) {
     if (r == 0 && file_exist("test/hhgttg.txt")) {
         r = test_compression("test/hhgttg.txt");
     }
+    for (level = lz77_level_fastest; level <= lz77_level_best; level++) {
+        if (r == 0 && file_exist("test/hhgttg.txt")) {
+            r = test_compression("test/hhgttg.txt");
+        }
+    }
+    level = 0;
+    if (r == 0 && file_exist("test/hhgttg.txt")) {
+        finder = lz77_finder_scan;
+        r = test_compression("test/hhgttg.txt");
+        finder = lz77_finder_level;
+    }
+    // lzn_window_bits suffix array blocks are 4KB: hhgttg.txt is
+    // indexed in many lz77_sa_index() blocks
+    if (r == 0 && file_exist("test/hhgttg.txt")) {
+        const uint8_t* data = null;
+        size_t bytes = 0;
+        r = read_whole_file("test/hhgttg.txt", &data, &bytes);
+        if (r == 0) {
+            r = test_sa_finder(data, bytes < 100000 ? bytes : 100000);
+            free((void*)data);
+        }
+    }
+    for (finder = lz77_finder_tree; finder <= lz77_finder_sa; finder++) {
+        if (r == 0 && file_exist("test/hhgttg.txt")) {
+            r = test_compression("test/hhgttg.txt");
+        }
+    }
+    finder = lz77_finder_level;
+    if (r == 0 && file_exist("test/hhgttg.txt")) {
+        window_bits = lz77_window_bits_max;
+        r = test_compression("test/hhgttg.txt");
+        window_bits = lzn_window_bits;
+    }
+    if (r == 0 && file_exist("test/hhgttg.txt")) {
+        long_distance = true;
+        r = test_compression("test/hhgttg.txt");
+        long_distance = false;
+    }
+    if (r == 0 && file_exist("test/hhgttg.txt")) {
+        word_io = true;
+        r = test_compression("test/hhgttg.txt");
+        word_io = false;
+    }
+    for (level = lz77_level_fastest; level <= lz77_level_best; level += 4) {
+        if (r == 0 && file_exist("test/hhgttg.txt")) {
+            coding = lz77_coding_bucket;
+            r = test_compression("test/hhgttg.txt");
+            coding = lz77_coding_varint;
+        }
+    }
+    level = 0;
+    if (r == 0 && file_exist("test/hhgttg.txt")) {
+        coding = lz77_coding_bucket;
+        long_distance = true;
+        window_bits = lz77_window_bits_max;
+        r = test_compression("test/hhgttg.txt");
+        window_bits = lzn_window_bits;
+        long_distance = false;
+        coding = lz77_coding_varint;
+    }
+    if (r == 0) { r = test_legacy(); }
+    if (r == 0) { r = test_small_nice(); }
+    if (r == 0) { r = test_far(); }
     if (r == 0) {
         const char* data = "Hello World Hello.World Hello World";
         size_t bytes = strlen((const char*)data);
@@ -234,6 +563,7 @@ int main(int argc, const char* argv[]) {
     if (r == 0 && file_exist(exe)) {
         r = test_compression(exe);
     }
+    if (r == 0) { hash_benchmark(); }
     return r;
 }
 
@@ -245,3 +575,65 @@ int main(int argc, const char* argv[]) {
 
 #define lz77_implementation // this will include the implementation of lz77
 #include "lz77.h"
+
+static void hash_benchmark(void) {
+    // lz77_hash() speed and how evenly it fills 1 << 16 buckets
+    // with every position of 1MB of pseudo random text
+    enum { n = 1024 * 1024, bits = 16 };
+    static uint8_t data[n + 8];
+    static uint32_t bucket[1 << bits];
+    uint32_t seed = 1;
+    for (size_t i = 0; i < sizeof(data); i++) {
+        seed = seed * 1664525U + 1013904223U;
+        data[i] = (uint8_t)('a' + (seed >> 24) % 16);
+    }
+    for (uint8_t len = 3; len <= 5; len++) {
+        memset(bucket, 0x00, sizeof(bucket));
+        const clock_t start = clock();
+        for (size_t i = 0; i < n; i++) {
+            bucket[lz77_hash(data + i, len, bits)]++;
+        }
+        const double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+        uint32_t used = 0;
+        for (size_t i = 0; i < rt_countof(bucket); i++) {
+            used += bucket[i] != 0;
+        }
+        rt_println("lz77_hash(%d bytes) %.0f MB/s %.1f%% buckets used",
+                   len, seconds > 0 ? n / seconds / 1e6 : 0.0,
+                   used * 100.0 / rt_countof(bucket));
+    }
+}
+
+static errno_t test_sa_finder(const uint8_t* data, size_t bytes) {
+    // the suffix array finder must find the same longest and closest
+    // match as the exhaustive scan at every position, also near the ends
+    // of its blocks (window_bits 12 indexes 8KB blocks)
+    const size_t window = (size_t)1 << 12;
+    lz77_t lz = {
+        .chain = UINT32_MAX,
+        .nice = UINT32_MAX,
+        .min_match = lz77_min_match_min
+    };
+    lz77_finder_t sa;
+    lz77_finder_t scan;
+    lz.finder = lz77_finder_sa;
+    lz77_finder_init(&lz, &sa, data, bytes, window);
+    lz.finder = lz77_finder_scan;
+    lz77_finder_init(&lz, &scan, data, bytes, window);
+    errno_t r = lz.error;
+    for (size_t i = 0; i < bytes && r == 0; i++) {
+        size_t len0 = 0, pos0 = 0, len1 = 0, pos1 = 0;
+        lz77_find(&sa, i, &len0, &pos0);
+        lz77_find(&scan, i, &len1, &pos1);
+        if (len0 != len1 || pos0 != pos1) {
+            rt_println("data[%lld] sa: %lld @ %lld scan: %lld @ %lld",
+                       (int64_t)i, (int64_t)len0, (int64_t)pos0,
+                       (int64_t)len1, (int64_t)pos1);
+            r = ENODATA;
+        }
+    }
+    lz77_finder_fini(&sa);
+    lz77_finder_fini(&scan);
+    rt_assert(r == 0);
+    return r;
+}